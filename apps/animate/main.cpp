@@ -4,10 +4,13 @@ static_assert(false, "Visualization not implemented");
 
 #include "simulation_stream.h"
 #include "simulation.h"
-#include "policy.h"
+#include "configuration.h"
+#include "trajectory_writer.h"
 #include <xul/time_meter/optional_meter.h>
 #include <xul/time_meter/system_meter.h>
+#include <algorithm>
 #include <iostream>
+#include <memory>
 
 void cfl_warn()
 {
@@ -16,20 +19,8 @@ void cfl_warn()
 #endif
 }
 
-#ifdef ENABLE_DOUBLE_PRECISION
-using data_type = double;
-#else
-using data_type = float;
-#endif
-
-#ifdef ENABLE_CFL_CHECK
-constexpr bool cfl_check = true;
-#else
-constexpr bool cfl_check = false;
-#endif
-
-using policy_type = fluid::sequential_policy<data_type,cfl_check>;
-using simulation_type = fluid::simulation<data_type, policy_type>;
+using policy_type = fluid::configured_policy<fluid::sequential_policy>;
+using simulation_type = fluid::simulation<fluid::configuration::data_type, policy_type>;
 
 int main(int argc, char *argv[])
 {
@@ -56,6 +47,7 @@ int main(int argc, char *argv[])
   cfl_warn();
 
   using namespace fluid;
+  using namespace fluid::configuration;
 
   std::cout << "Loading file \"" << argv[3] << "\"..." << std::endl;
   simulation_istream file(argv[3]);
@@ -64,22 +56,52 @@ int main(int argc, char *argv[])
   unsigned int np;
   file.read_header(ppm,np);
 
-  simulation_type sim(ppm,np);
+  simulation_type sim(ppm,np,reorder_interval,verlet_skin);
 
+  xul::time_meter::optional_meter<xul::time_meter::system_meter<std::chrono::system_clock>> load_meter;
+  load_meter.start();
   sim.read(file);
+  load_meter.stop();
   std::cout << "Number of cells: " << sim.num_cells() << std::endl;
   std::cout << "Number of particles: " << np << std::endl;
   std::cout << "Particles per meter: " << ppm << std::endl;
+  if (load_meter.is_active()) {
+    const auto us = std::max<long long>(load_meter.count<std::chrono::microseconds>(), 1);
+    std::cout << "Loading rate (particles/s): " << static_cast<long long>(np * 1e6 / us) << std::endl;
+  }
+  if (kernel == kernel_mode::simd) {
+    std::cout << "SIMD instruction set: " << instruction_set_name(select_instruction_set()) << std::endl;
+  }
+
+  // Every trajectory_interval-th frame is written next to the output file,
+  // either as a .fluid file or as a frame of a compact trajectory
+  std::unique_ptr<trajectory_writer> trajectory;
+  if (trajectory_interval > 0 && argc > 4) {
+    auto write = compact_trajectory
+        ? compact_snapshots(std::make_shared<trajectory_ostream>(trajectory_file_name(argv[4]), ppm, np,
+              sim.cell_domain(), trajectory_position_bits, trajectory_velocity_bits))
+        : fluid_snapshots(argv[4], ppm, np);
+    trajectory.reset(new trajectory_writer(write, trajectory_interval, trajectory_backlog));
+  }
 
   xul::time_meter::optional_meter<xul::time_meter::system_meter<std::chrono::system_clock>> meter;
   meter.start();
 
   for(int i = 0; i < framenum; ++i) {
     sim.advance_frame();
+    if (trajectory) {
+      trajectory->record(sim, i + 1);
+    }
   }
 
   meter.stop();
 
+  if (trajectory) {
+    trajectory->finish();
+    std::cout << "Trajectory snapshots: " << trajectory->num_snapshots()
+              << ", stalls: " << trajectory->num_stalls() << std::endl;
+  }
+
   if(argc > 4) {
     std::cout << "Saving file \"" << argv[4]<< "\"..." << std::endl;
     simulation_ostream file(argv[4]);
@@ -6,6 +6,8 @@
 #include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <vector>
 
 #include <string.h>
 #include <math.h>
@@ -48,6 +50,19 @@ typedef struct {
     bool doTest;
     float tol;
   } bbox;
+  //Match particles by position instead of by order
+  bool unordered;
+  //Accuracy report, with optional tests of its mean values and energy
+  bool report;
+  struct {
+    bool doTest;
+    float ptol;
+    float vtol;
+  } mtest;
+  struct {
+    bool doTest;
+    float tol;
+  } etest;
 } conf_t;
 
 
@@ -177,6 +192,57 @@ void ReadFile(char const *fileName, fluid_t *f)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Reorders the particles of a fluid so that each takes the place of the
+// nearest reference particle within the position tolerance. Fluids whose
+// particles are stored in another order can then be compared particle by
+// particle. Particles without a match fill the remaining places and fail
+// the position test.
+void match_particles(fluid_t *fluid, fluid_t *rfluid, float tol) {
+  const int n = fluid->numParticles;
+  std::vector<int> order(n);
+  for(int j=0; j<n; j++) order[j] = j;
+  std::sort(order.begin(), order.end(), [rfluid](int a, int b) { return rfluid->p[a].x < rfluid->p[b].x; });
+  std::vector<float> xs(n);
+  for(int k=0; k<n; k++) xs[k] = rfluid->p[order[k]].x;
+
+  std::vector<int> place(n, -1);
+  std::vector<int> unmatched;
+  for(int i=0; i<n; i++) {
+    const Vec3 &p = fluid->p[i];
+    int best = -1;
+    float bestDistance = INFINITY;
+    for(int k = std::lower_bound(xs.begin(), xs.end(), p.x - tol) - xs.begin(); k<n && xs[k] <= p.x + tol; k++) {
+      const int j = order[k];
+      const Vec3 &r = rfluid->p[j];
+      if(place[j] >= 0 || fabs(p.y - r.y) > tol || fabs(p.z - r.z) > tol) continue;
+      const float distance = (p.x - r.x) * (p.x - r.x) + (p.y - r.y) * (p.y - r.y) + (p.z - r.z) * (p.z - r.z);
+      if(distance < bestDistance) {
+        best = j;
+        bestDistance = distance;
+      }
+    }
+    if(best >= 0) place[best] = i;
+    else unmatched.push_back(i);
+  }
+  for(int j=0, k=0; j<n; j++) {
+    if(place[j] < 0) place[j] = unmatched[k++];
+  }
+
+  fluid_t sorted;
+  malloc_fluid(&sorted, n);
+  for(int j=0; j<n; j++) {
+    sorted.p[j] = fluid->p[place[j]];
+    sorted.hv[j] = fluid->hv[place[j]];
+    sorted.v[j] = fluid->v[place[j]];
+  }
+  std::swap(fluid->p, sorted.p);
+  std::swap(fluid->hv, sorted.hv);
+  std::swap(fluid->v, sorted.v);
+  free_fluid(&sorted);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 // Test functions
 // All functions are independent from each other and return true if the test is passed, false otherwise.
 
@@ -256,6 +322,76 @@ bool verify_bbox(fluid_t *fluid, fluid_t *rfluid, conf_t *conf) {
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+
+// Accuracy report
+// Statistics that do not depend on the order of particles, so that fluids
+// whose particles are stored in a different order can still be compared.
+typedef struct {
+  double p[3];
+  double v[3];
+  double energy;
+} summary_t;
+
+void summarize(fluid_t *f, summary_t *s) {
+  memset(s, 0, sizeof(summary_t));
+  for(int i=0; i<f->numParticles; i++) {
+    s->p[0] += f->p[i].x;
+    s->p[1] += f->p[i].y;
+    s->p[2] += f->p[i].z;
+    s->v[0] += f->v[i].x;
+    s->v[1] += f->v[i].y;
+    s->v[2] += f->v[i].z;
+    s->energy += 0.5 * ((double)f->v[i].x * f->v[i].x + (double)f->v[i].y * f->v[i].y + (double)f->v[i].z * f->v[i].z);
+  }
+  for(int d=0; d<3; d++) {
+    s->p[d] /= f->numParticles;
+    s->v[d] /= f->numParticles;
+  }
+  s->energy /= f->numParticles;
+}
+
+double print_vector_report(const char *name, const double *e, const double *r) {
+  double diff = 0.0;
+  bool nan = false;
+  for(int d=0; d<3; d++) {
+    diff = fmax(diff, fabs(r[d] - e[d]));
+    nan |= isnan(r[d] - e[d]);
+  }
+  if(nan) diff = NAN;
+  std::cout << name << "Expected <" << e[0] << "," << e[1] << "," << e[2] << ">"
+            << " Received <" << r[0] << "," << r[1] << "," << r[2] << ">"
+            << " Max difference " << diff << std::endl;
+  return diff;
+}
+
+// Prints the report, and verifies mean positions and velocities with
+// absolute tolerances mtest.ptol and mtest.vtol and kinetic energies with
+// relative tolerance etest.tol, where requested
+void print_report(fluid_t *fluid, fluid_t *rfluid, conf_t *conf, bool *mresult, bool *eresult) {
+  summary_t s, rs;
+  summarize(fluid, &s);
+  summarize(rfluid, &rs);
+
+  const double bmin[3] = {fluid->bbox.min.x, fluid->bbox.min.y, fluid->bbox.min.z};
+  const double bmax[3] = {fluid->bbox.max.x, fluid->bbox.max.y, fluid->bbox.max.z};
+  const double rbmin[3] = {rfluid->bbox.min.x, rfluid->bbox.min.y, rfluid->bbox.min.z};
+  const double rbmax[3] = {rfluid->bbox.max.x, rfluid->bbox.max.y, rfluid->bbox.max.z};
+
+  std::cout << "Accuracy report" << std::endl;
+  const double pdiff = print_vector_report("  Mean position:      ", rs.p, s.p);
+  const double vdiff = print_vector_report("  Mean velocity:      ", rs.v, s.v);
+  print_vector_report("  Bounding box min:   ", rbmin, bmin);
+  print_vector_report("  Bounding box max:   ", rbmax, bmax);
+  const double ediff = fabs(s.energy - rs.energy) / rs.energy;
+  std::cout << "  Kinetic energy:     Expected " << rs.energy << " Received " << s.energy
+            << " Relative difference " << ediff << std::endl;
+
+  //NaN differences fail
+  *mresult = !conf->mtest.doTest || (pdiff <= conf->mtest.ptol && vdiff <= conf->mtest.vtol);
+  *eresult = !conf->etest.doTest || ediff <= conf->etest.tol;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 // Print usage information
@@ -268,6 +404,11 @@ void print_usage(const char *name) {
   std::cout << "  --ptol FLOAT  Compare positions with absolute tolerance FLOAT" << std::endl; 
   std::cout << "  --vtol FLOAT  Compare velocities with absolute tolerance FLOAT" << std::endl;
   std::cout << "  --bbox FLOAT  Compare bounding boxes with absolute tolerance FLOAT" << std::endl;
+  std::cout << "  --unordered   Compare each particle with the nearest reference particle within the position tolerance, not the one of the same index" << std::endl;
+  std::cout << "  --report      Print mean positions, velocities and kinetic energies of both fluids" << std::endl;
+  std::cout << "  --mptol FLOAT Report, and compare mean positions with absolute tolerance FLOAT" << std::endl;
+  std::cout << "  --mvtol FLOAT Report, and compare mean velocities with absolute tolerance FLOAT" << std::endl;
+  std::cout << "  --etol FLOAT  Report, and compare kinetic energies with relative tolerance FLOAT" << std::endl;
 }
 
 // Parse command line arguments
@@ -287,6 +428,13 @@ bool parse_args(conf_t *conf, int argc, char *argv[]) {
   conf->vtest.tol = 0.0;
   conf->bbox.doTest = false;
   conf->bbox.tol = 0.0;
+  conf->unordered = false;
+  conf->report = false;
+  conf->mtest.doTest = false;
+  conf->mtest.ptol = INFINITY;
+  conf->mtest.vtol = INFINITY;
+  conf->etest.doTest = false;
+  conf->etest.tol = 0.0;
 
   //need at least two input files
   if(argc < 3) return false;
@@ -315,6 +463,28 @@ bool parse_args(conf_t *conf, int argc, char *argv[]) {
       conf->bbox.doTest = true;
       conf->bbox.tol = atof(argv[i+1]);
       i++;
+    } else if(!strcmp(argv[i],"--unordered")) {
+      conf->unordered = true;
+    } else if(!strcmp(argv[i],"--report")) {
+      conf->report = true;
+    } else if(!strcmp(argv[i],"--mptol")) {
+      if(i+1>=argc) return false;
+      conf->report = true;
+      conf->mtest.doTest = true;
+      conf->mtest.ptol = atof(argv[i+1]);
+      i++;
+    } else if(!strcmp(argv[i],"--mvtol")) {
+      if(i+1>=argc) return false;
+      conf->report = true;
+      conf->mtest.doTest = true;
+      conf->mtest.vtol = atof(argv[i+1]);
+      i++;
+    } else if(!strcmp(argv[i],"--etol")) {
+      if(i+1>=argc) return false;
+      conf->report = true;
+      conf->etest.doTest = true;
+      conf->etest.tol = atof(argv[i+1]);
+      i++;
     } else {
       return false;
     }
@@ -335,6 +505,8 @@ int main(int argc, char *argv[]) {
     bool ptest;
     bool vtest;
     bool bbox;
+    bool mtest;
+    bool etest;
   } results;
 
   //parse arguments
@@ -361,6 +533,15 @@ int main(int argc, char *argv[]) {
     return ERROR_FAIL;
   }
 
+  //match particles by position
+  if(conf.unordered) {
+    if(!conf.ptest.doTest) {
+      std::cerr << "Matching particles by position requires --ptol" << std::endl;
+      return ERROR_OTHER;
+    }
+    match_particles(&fluid, &rfluid, conf.ptest.tol);
+  }
+
   //verify positions
   if(conf.ptest.doTest) {
     results.ptest = verify_ptest(&fluid, &rfluid, &conf);
@@ -382,6 +563,13 @@ int main(int argc, char *argv[]) {
     results.bbox = true;
   }
 
+  if(conf.report) {
+    print_report(&fluid, &rfluid, &conf, &results.mtest, &results.etest);
+  } else {
+    results.mtest = true;
+    results.etest = true;
+  }
+
   free_fluid(&rfluid);
   free_fluid(&fluid);
 
@@ -395,7 +583,13 @@ int main(int argc, char *argv[]) {
   if(conf.bbox.doTest) {
     std::cout << "Bounding box test:    " << (results.bbox ? "PASS" : "FAIL") << std::endl;
   }
-  return (results.ptest && results.vtest &&results.bbox) ? ERROR_OK : ERROR_FAIL;
+  if(conf.mtest.doTest) {
+    std::cout << "Mean value test:      " << (results.mtest ? "PASS" : "FAIL") << std::endl;
+  }
+  if(conf.etest.doTest) {
+    std::cout << "Energy test:          " << (results.etest ? "PASS" : "FAIL") << std::endl;
+  }
+  return (results.ptest && results.vtest &&results.bbox && results.mtest && results.etest) ? ERROR_OK : ERROR_FAIL;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,63 @@
+#include "simulation_stream.h"
+#include "params.h"
+#include <iostream>
+#include <cmath>
+
+// Generates a synthetic scene: a layer of fluid at rest covering the
+// bottom of the domain with particles placed on a regular lattice.
+int main(int argc, char *argv[])
+{
+  if(argc != 4)
+  {
+    std::cerr << "Usage: " << argv[0] << " <particles per meter> <particles> <.fluid output file>" << std::endl;
+    return -1;
+  }
+
+  float ppm = std::stof(argv[1]);
+  long np = std::stol(argv[2]);
+
+  //Check arguments
+  if (ppm <= 0) {
+    std::cerr << "<particles per meter> must be positive" << std::endl;
+    return -1;
+  }
+  if (np < 1) {
+    std::cerr << "<particles> must at least be 1" << std::endl;
+    return -1;
+  }
+
+  using namespace fluid;
+  using namespace fluid::constants;
+
+  const float spacing = 1.0f / ppm;
+  const auto min = DOMAIN_MIN<float>() + spacing / 2;
+  const auto range = DOMAIN_RANGE<float>();
+  const long nx = static_cast<long>(range.x() * ppm);
+  const long ny = static_cast<long>(range.y() * ppm);
+  const long nz = static_cast<long>(range.z() * ppm);
+  if (np > nx * ny * nz) {
+    std::cerr << "Too many particles for " << ppm << " particles per meter" << std::endl;
+    return -1;
+  }
+
+  std::cout << "Generating " << np << " particles in file \"" << argv[3] << "\"..." << std::endl;
+  simulation_ostream file(argv[3]);
+  file.write_header(ppm, static_cast<unsigned int>(np));
+
+  const space_vector<float> zero{0, 0, 0};
+  for (long i = 0; i < np; ++i) {
+    long layer = i / (nx * nz);
+    long row = (i / nx) % nz;
+    long col = i % nx;
+    space_vector<float> position{
+      min.x() + col * spacing,
+      min.y() + layer * spacing,
+      min.z() + row * spacing
+    };
+    file.write_space_vector(position);
+    file.write_space_vector(zero);
+    file.write_space_vector(zero);
+  }
+
+  return 0;
+}
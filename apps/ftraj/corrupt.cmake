@@ -0,0 +1,34 @@
+# Decodes copies of trajectory INPUT with single bytes inverted, written to
+# OUTPUT by FFLIP. FTRAJ must decode every copy or reject it with an error,
+# and must reject some. Every byte of the header, the first frame header and
+# the start of its payload is inverted, then about 200 bytes over the rest.
+file(READ "${INPUT}" CONTENT HEX)
+string(LENGTH "${CONTENT}" LENGTH)
+math(EXPR SIZE "${LENGTH} / 2")
+math(EXPR STRIDE "${SIZE} / 200 + 1")
+
+set(REJECTED 0)
+set(OFFSET 0)
+while (OFFSET LESS SIZE)
+  execute_process(COMMAND "${FFLIP}" "${INPUT}" "${OUTPUT}" ${OFFSET} RESULT_VARIABLE RESULT)
+  if (NOT RESULT EQUAL 0)
+    message(FATAL_ERROR "Could not invert byte ${OFFSET}: ${RESULT}")
+  endif()
+  execute_process(COMMAND "${FTRAJ}" "${OUTPUT}" RESULT_VARIABLE RESULT OUTPUT_QUIET ERROR_QUIET)
+  if (RESULT EQUAL 255)
+    math(EXPR REJECTED "${REJECTED} + 1")
+  elseif (NOT RESULT EQUAL 0)
+    message(FATAL_ERROR "ftraj failed with byte ${OFFSET} inverted: ${RESULT}")
+  endif()
+
+  if (OFFSET LESS 128)
+    math(EXPR OFFSET "${OFFSET} + 1")
+  else()
+    math(EXPR OFFSET "${OFFSET} + ${STRIDE}")
+  endif()
+endwhile()
+
+if (REJECTED EQUAL 0)
+  message(FATAL_ERROR "ftraj rejected none of the corrupt trajectories")
+endif()
+message(STATUS "ftraj rejected ${REJECTED} corrupt trajectories")
@@ -0,0 +1,38 @@
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Copies a file with the bits of the byte at the given offset inverted, to
+// check that readers reject or survive corrupt files
+int main(int argc, char *argv[])
+{
+  if(argc != 4)
+  {
+    std::cerr << "Usage: " << argv[0] << " <input file> <output file> <offset>" << std::endl;
+    return -1;
+  }
+
+  std::ifstream in(argv[1], std::ios::binary);
+  if (!in) {
+    std::cerr << "Error opening input file" << std::endl;
+    return -1;
+  }
+  std::vector<char> bytes{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+
+  const unsigned long offset = std::stoul(argv[3]);
+  if (offset >= bytes.size()) {
+    std::cerr << "Offset beyond the end of the input file" << std::endl;
+    return -1;
+  }
+  bytes[offset] = static_cast<char>(~bytes[offset]);
+
+  std::ofstream out(argv[2], std::ios::binary);
+  out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+  if (!out) {
+    std::cerr << "Error writing output file" << std::endl;
+    return -1;
+  }
+  return 0;
+}
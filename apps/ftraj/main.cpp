@@ -0,0 +1,68 @@
+#include "trajectory_stream.h"
+#include <exception>
+#include <iostream>
+#include <string>
+
+// Converts the frames of a compact trajectory back to .fluid files. Frames
+// are decoded one at a time, so that files of any length fit in memory.
+int convert(int argc, char *argv[])
+{
+  using namespace fluid;
+
+  trajectory_istream trajectory(argv[1]);
+  const trajectory_header & h = trajectory.header();
+  std::cout << "Number of particles: " << h.np << std::endl;
+  std::cout << "Particles per meter: " << h.ppm << std::endl;
+  std::cout << "Position error bound: " << h.position_bound << std::endl;
+  std::cout << "Velocity error bound: " << h.velocity_bound << std::endl;
+
+  const bool single = argc > 3;
+  const int selected = single ? std::stoi(argv[3]) : 0;
+
+  std::vector<float> values;
+  int frame;
+  int nframes = 0;
+  std::size_t nbytes = 0;
+  bool found = false;
+  while (trajectory.read_frame(frame, values)) {
+    ++nframes;
+    nbytes += trajectory.frame_size();
+    if (argc < 3 || (single && frame != selected)) continue;
+
+    simulation_ostream file(single ? std::string{argv[2]} : snapshot_file_name(argv[2], frame));
+    file.write_header(h.ppm, h.np);
+    file.write_particles(values.data(), 0, h.np);
+    file.skip_particles(h.np);
+    found = true;
+  }
+  std::cout << "Number of frames: " << nframes << std::endl;
+  if (nframes > 0 && h.np > 0) {
+    std::cout << "Bytes per particle and frame: " << double(nbytes) / nframes / h.np
+              << " (36 in .fluid files)" << std::endl;
+  }
+
+  if (single && !found) {
+    std::cerr << "Frame " << selected << " not found" << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 2 || argc > 4)
+  {
+    std::cerr << "Usage: " << argv[0] << " <.ftraj input file> [.fluid output file] [frame]" << std::endl;
+    std::cerr << "Without a frame, frame f is written to <output>_<f>.fluid for every frame." << std::endl;
+    return -1;
+  }
+
+  // Corrupt or truncated files are reported, not aborted on
+  try {
+    return convert(argc, argv);
+  }
+  catch (const std::exception & e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return -1;
+  }
+}
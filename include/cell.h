@@ -1,14 +1,17 @@
 #ifndef FLUID_CELL_H
 #define FLUID_CELL_H
 
-#include "particle.h"
+#include "particle_storage.h"
 #include <yapl/cube.h>
 #include <yapl/policy.h>
 #include <tbb/tbb.h>
 #include <tbb/scalable_allocator.h>
 #include <vector>
+#include <algorithm>
+#include <utility>
 #include <mutex>
 #include <type_traits>
+#include <cstdint>
 
 #include <iostream>
 #include <cassert>
@@ -65,11 +68,12 @@ private:
   tbb::spin_mutex mtx_;
 };
 
-template <typename T, typename M, bool CFL>
+template <typename T, typename M, bool CFL, typename S = aos_storage<T>>
 class cell : public std::conditional<CFL,cfl_checker,null_checker>::type {
 public:
   using checker_type = typename std::conditional<CFL, cfl_checker, null_checker>::type;
   using index_type = yapl::cube_index;
+  using particle_type = typename S::value_type;
 
   cell();
 
@@ -79,14 +83,25 @@ public:
   cell(cell && c) = delete;
   cell & operator=(cell && c) = delete;
 
-  void add_neighbour(cell<T,M,CFL> & c);
-
   void clear_particles();
-  void add_particle(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v);
-  void add_particle(const particle<T> & p) { 
+  bool add_particle(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v);
+
+  // Removes the particles for which f returns true. The remaining
+  // particles keep their order.
+  template <typename F>
+  void remove_particles_if(F f);
+
+  // Cells viewing a range of a shared particle storage
+  template <typename B>
+  void assign_particles(B & buffer, size_t first, size_t last) { particles_.assign(buffer, first, last); }
+
+  // Returns true if the storage of the cell had to grow
+  bool add_particle(const particle_type & p) { 
     using namespace std;
     lock_guard<M> l{mutex_};
+    const bool grows = particles_.size() == particles_.capacity();
     particles_.push_back(p); 
+    return grows;
   }
   size_t num_particles() const { 
     using namespace std;
@@ -98,25 +113,67 @@ public:
   void for_all_particles(F f) {
     using namespace std;
     lock_guard<M> l{mutex_};
-    for (auto & p : particles_) { f(p); }
+    for (size_t i=0; i<particles_.size(); ++i) {
+      auto && p = particles_[i];
+      f(p);
+    }
   }
 
   template <typename F>
   void for_all_particles(F f) const {
     using namespace std;
     lock_guard<M> l{mutex_};
-    for (auto & p : particles_) { f(p); }
+    for (size_t i=0; i<particles_.size(); ++i) {
+      auto && p = particles_[i];
+      f(p);
+    }
   }
 
-  template <typename F>
-  void for_all_near_particles(F f);
+  // Neighbour cells are given as a range [first,last) of cell pointers.
+  // Without Lock no other thread may access this cell or its neighbours.
+  template <bool Lock, typename I, typename F>
+  void for_all_near_particles(I first, I last, F f);
+
+  // Applies f(pi,pj) to pairs of particles of this cell, as
+  // for_all_near_particles does, and g(pi,np,k,j) to pairs of every
+  // particle pi of this cell with the particle np, numbered j, of the k-th
+  // neighbour in [first,last). Takes no locks.
+  template <typename I, typename F, typename G>
+  void for_all_near_indexed(I first, I last, F f, G g);
+
+  // Applies f(pi,pj) to every particle pi of this cell and every other
+  // particle pj of this cell or of all its neighbours [first,last).
+  // f may only modify pi, so that no locks are needed.
+  template <typename I, typename F>
+  void gather_near_particles(I first, I last, F f);
+
+  // Applies f(a,a) to the block a of particles of this cell and f(a,b)
+  // to the block b of every neighbour. Requires soa_storage.
+  template <bool Lock, typename I, typename F>
+  void for_all_near_blocks(I first, I last, F f);
+
+  // Verlet lists: pairs of particles of this cell and its neighbours closer
+  // than a radius. Lists are valid until particles are moved to other cells
+  // or reordered, and must be traversed with the same neighbours.
+  // Positions of all cells must be saved before building.
+  void save_positions();
+  template <typename I>
+  void build_near_pairs(I first, I last, T radius_sq);
+  template <bool Lock, typename I, typename F>
+  void for_all_listed_pairs(I first, I last, F f);
+  T max_square_displacement() const;
+
+  // Sorts particles by the value of key(p). Keys and a copy of the
+  // particles are kept in keys and scratch, which are reused across cells.
+  template <typename K, typename I>
+  void reorder_particles(K key, std::vector<std::pair<I,size_t>> & keys, S & scratch);
 
   template <class OS>
   friend OS & operator<<(OS & os, const cell & c) {
     using namespace std;
     lock_guard<M> l{c.mutex_};
-    for (auto & p : c.particles_) {
-      os << p << std::endl;
+    for (size_t i=0; i<c.particles_.size(); ++i) {
+      os << c.particles_[i] << std::endl;
     }
     return os;
   }
@@ -126,69 +183,275 @@ public:
   void check(const index_type & i) const {checker_type::check(i); }
   
 protected:
-  std::vector<particle<T>> particles_;
-  std::vector<cell<T,M,CFL>*> neighbours_;
+  S particles_;
   mutable M mutex_;
+
+  // Locks this cell and a neighbour only if Lock
+  template <bool Lock>
+  void lock_with(cell & nc) {
+    if (Lock) std::lock(mutex_, nc.mutex_);
+  }
+  template <bool Lock>
+  void unlock_with(cell & nc) {
+    if (Lock) {
+      mutex_.unlock();
+      nc.mutex_.unlock();
+    }
+  }
+
+  // Verlet lists: pairs of indices (in this cell, in the other cell).
+  // near_ends_[0] ends pairs within this cell and near_ends_[k+1] pairs
+  // with the k-th neighbour. Positions of particles when lists were built.
+  std::vector<std::pair<std::uint32_t,std::uint32_t>> near_pairs_;
+  std::vector<size_t> near_ends_;
+  std::vector<space_vector<T>> near_origins_;
 };
 
-template <typename T, typename M, bool CFL>
-cell<T,M,CFL>::cell()
+template <typename T, typename M, bool CFL, typename S>
+cell<T,M,CFL,S>::cell()
 :
 particles_{},
-neighbours_{}
-{
-  neighbours_.reserve(13);
-}
-
-template <typename T, typename M, bool CFL>
-void cell<T,M,CFL>::add_neighbour(cell<T,M,CFL> & c) 
+near_pairs_{},
+near_ends_{},
+near_origins_{}
 {
-  neighbours_.push_back(&c);
 }
 
-template <typename T, typename M, bool CFL>
-void cell<T,M,CFL>::clear_particles()
+template <typename T, typename M, bool CFL, typename S>
+void cell<T,M,CFL,S>::clear_particles()
 {
   using namespace std;
   lock_guard<M> l{mutex_};
+  // Capacity is kept so that refilling the cell does not allocate
   particles_.clear();
-  particles_.shrink_to_fit();
 }
 
-template <typename T, typename M, bool CFL>
-void cell<T,M,CFL>::add_particle(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v)
+template <typename T, typename M, bool CFL, typename S>
+bool cell<T,M,CFL,S>::add_particle(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v)
 {
   using namespace std;
   lock_guard<M> l{mutex_};
+  const bool grows = particles_.size() == particles_.capacity();
   particles_.emplace_back(p,hv,v);
+  return grows;
 }
 
-template <typename T, typename M, bool CFL>
+template <typename T, typename M, bool CFL, typename S>
 template <typename F>
-void cell<T,M,CFL>::for_all_near_particles(F f)
+void cell<T,M,CFL,S>::remove_particles_if(F f)
 {
   using namespace std;
-  auto begin = particles_.begin();
-  auto end = particles_.end();
-  for (auto i=begin; i!=end; ++i) {
-    {
-      lock_guard<M> l{mutex_};
-      for (auto j=begin; j!=i; ++j) {
-        f(*i,*j);
-      }
+  lock_guard<M> l{mutex_};
+  size_t k = 0;
+  for (size_t i=0; i<particles_.size(); ++i) {
+    auto && p = particles_[i];
+    if (f(p)) continue;
+    if (k != i) {
+      particles_[k] = p;
     }
+    ++k;
+  }
+  while (particles_.size() > k) {
+    particles_.pop_back();
+  }
+}
+
+template <typename T, typename M, bool CFL, typename S>
+template <bool Lock, typename I, typename F>
+void cell<T,M,CFL,S>::for_all_near_particles(I first, I last, F f)
+{
+  using namespace std;
+  const size_t n = particles_.size();
+  for (size_t i=0; i<n; ++i) {
+    auto && pi = particles_[i];
+    if (Lock) mutex_.lock();
+    for (size_t j=0; j!=i; ++j) {
+      auto && pj = particles_[j];
+      f(pi,pj);
+    }
+    if (Lock) mutex_.unlock();
     
-    for (auto & nc : neighbours_) {
-      lock(mutex_, nc->mutex_);
-      for (auto & np : nc->particles_) {
-        f(*i,np);
+    for (I it=first; it!=last; ++it) {
+      auto nc = *it;
+      lock_with<Lock>(*nc);
+      const size_t nn = nc->particles_.size();
+      for (size_t j=0; j<nn; ++j) {
+        auto && np = nc->particles_[j];
+        f(pi,np);
       }
-      mutex_.unlock();
-      nc->mutex_.unlock();
+      unlock_with<Lock>(*nc);
     };
   }
 }
 
+template <typename T, typename M, bool CFL, typename S>
+template <typename I, typename F, typename G>
+void cell<T,M,CFL,S>::for_all_near_indexed(I first, I last, F f, G g)
+{
+  const size_t n = particles_.size();
+  for (size_t i=0; i<n; ++i) {
+    auto && pi = particles_[i];
+    for (size_t j=0; j!=i; ++j) {
+      auto && pj = particles_[j];
+      f(pi,pj);
+    }
+
+    size_t k = 0;
+    for (I it=first; it!=last; ++it, ++k) {
+      auto nc = *it;
+      const size_t nn = nc->particles_.size();
+      for (size_t j=0; j<nn; ++j) {
+        auto && np = nc->particles_[j];
+        g(pi,np,k,j);
+      }
+    }
+  }
+}
+
+template <typename T, typename M, bool CFL, typename S>
+template <typename I, typename F>
+void cell<T,M,CFL,S>::gather_near_particles(I first, I last, F f)
+{
+  const size_t n = particles_.size();
+  for (size_t i=0; i<n; ++i) {
+    auto && pi = particles_[i];
+    for (size_t j=0; j<n; ++j) {
+      if (j == i) continue;
+      auto && pj = particles_[j];
+      f(pi,pj);
+    }
+
+    for (I it=first; it!=last; ++it) {
+      auto nc = *it;
+      const size_t nn = nc->particles_.size();
+      for (size_t j=0; j<nn; ++j) {
+        auto && np = nc->particles_[j];
+        f(pi,np);
+      }
+    }
+  }
+}
+
+template <typename T, typename M, bool CFL, typename S>
+template <bool Lock, typename I, typename F>
+void cell<T,M,CFL,S>::for_all_near_blocks(I first, I last, F f)
+{
+  using namespace std;
+  const auto block = particles_.block();
+  if (block.size == 0) return;
+
+  if (Lock) mutex_.lock();
+  f(block, block);
+  if (Lock) mutex_.unlock();
+
+  for (I it=first; it!=last; ++it) {
+    auto nc = *it;
+    const auto near = nc->particles_.block();
+    if (near.size == 0) continue;
+    lock_with<Lock>(*nc);
+    f(block, near);
+    unlock_with<Lock>(*nc);
+  }
+}
+
+template <typename T, typename M, bool CFL, typename S>
+void cell<T,M,CFL,S>::save_positions()
+{
+  near_origins_.clear();
+  const size_t n = particles_.size();
+  for (size_t i=0; i<n; ++i) {
+    near_origins_.push_back(particles_[i].position());
+  }
+}
+
+template <typename T, typename M, bool CFL, typename S>
+template <typename I>
+void cell<T,M,CFL,S>::build_near_pairs(I first, I last, T radius_sq)
+{
+  using namespace std;
+  near_ends_.clear();
+  size_t k = 0;
+
+  // Every candidate pair is written and kept only if close enough,
+  // which avoids a hard to predict branch per pair.
+  auto add_pairs = [this,radius_sq,&k](const std::vector<space_vector<T>> & near, bool same) {
+    const size_t n = near_origins_.size();
+    near_pairs_.resize(k + n * near.size());
+    for (size_t i=0; i<n; ++i) {
+      const size_t last = same ? i : near.size();
+      for (size_t j=0; j<last; ++j) {
+        near_pairs_[k] = make_pair(i, j);
+        k += (near_origins_[i] - near[j]).norm() < radius_sq;
+      }
+    }
+    near_ends_.push_back(k);
+  };
+
+  add_pairs(near_origins_, true);
+  for (I it=first; it!=last; ++it) {
+    add_pairs((*it)->near_origins_, false);
+  }
+  near_pairs_.resize(k);
+}
+
+template <typename T, typename M, bool CFL, typename S>
+template <bool Lock, typename I, typename F>
+void cell<T,M,CFL,S>::for_all_listed_pairs(I first, I last, F f)
+{
+  using namespace std;
+  size_t k = 0;
+  if (Lock) mutex_.lock();
+  for (; k<near_ends_[0]; ++k) {
+    auto && pi = particles_[near_pairs_[k].first];
+    auto && pj = particles_[near_pairs_[k].second];
+    f(pi,pj);
+  }
+  if (Lock) mutex_.unlock();
+
+  size_t m = 1;
+  for (I it=first; it!=last; ++it, ++m) {
+    if (k == near_ends_[m]) continue;
+    auto nc = *it;
+    lock_with<Lock>(*nc);
+    for (; k<near_ends_[m]; ++k) {
+      auto && pi = particles_[near_pairs_[k].first];
+      auto && np = nc->particles_[near_pairs_[k].second];
+      f(pi,np);
+    }
+    unlock_with<Lock>(*nc);
+  }
+}
+
+template <typename T, typename M, bool CFL, typename S>
+T cell<T,M,CFL,S>::max_square_displacement() const
+{
+  T dmax{};
+  for (size_t i=0; i<near_origins_.size(); ++i) {
+    dmax = std::max(dmax, (particles_[i].position() - near_origins_[i]).norm());
+  }
+  return dmax;
+}
+
+template <typename T, typename M, bool CFL, typename S>
+template <typename K, typename I>
+void cell<T,M,CFL,S>::reorder_particles(K key, std::vector<std::pair<I,size_t>> & keys, S & scratch)
+{
+  using namespace std;
+  lock_guard<M> l{mutex_};
+  const size_t n = particles_.size();
+  keys.clear();
+  scratch.clear();
+  for (size_t i=0; i<n; ++i) {
+    keys.emplace_back(key(particles_[i]), i);
+    scratch.push_back(particles_[i]);
+  }
+  sort(keys.begin(), keys.end());
+
+  // Copying back keeps the storage of the cell with its spare capacity
+  for (size_t i=0; i<n; ++i) {
+    particles_[i] = scratch[keys[i].second];
+  }
+}
 
 }
 
@@ -0,0 +1,102 @@
+#ifndef FLUID_CELL_ORDER_H
+#define FLUID_CELL_ORDER_H
+
+#include <yapl/cube_index.h>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+namespace fluid {
+
+enum class cell_order {
+  linear, // x varying fastest
+  morton  // Z-order curve
+};
+
+// Spreads the lower 21 bits of v so that there are two zero bits
+// between every pair of consecutive bits.
+inline std::uint64_t spread_bits(std::uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffff;
+  v = (v | v << 16) & 0x1f0000ff0000ff;
+  v = (v | v << 8) & 0x100f00f00f00f00f;
+  v = (v | v << 4) & 0x10c30c30c30c30c3;
+  v = (v | v << 2) & 0x1249249249249249;
+  return v;
+}
+
+inline std::uint64_t morton_code(const yapl::cube_index & i)
+{
+  return spread_bits(i.get<0>()) |
+         (spread_bits(i.get<1>()) << 1) |
+         (spread_bits(i.get<2>()) << 2);
+}
+
+// Position of a point of a 2^bits lattice along a Hilbert curve
+// (J. Skilling, Programming the Hilbert curve, 2004).
+inline std::uint64_t hilbert_code(const yapl::cube_index & i, unsigned bits)
+{
+  std::uint32_t x[3] = {
+    static_cast<std::uint32_t>(i.get<0>()),
+    static_cast<std::uint32_t>(i.get<1>()),
+    static_cast<std::uint32_t>(i.get<2>())
+  };
+  const std::uint32_t m = std::uint32_t{1} << (bits - 1);
+
+  // Inverse undo excess work
+  for (std::uint32_t q = m; q > 1; q >>= 1) {
+    const std::uint32_t p = q - 1;
+    for (int d=0; d<3; ++d) {
+      if (x[d] & q) {
+        x[0] ^= p;
+      }
+      else {
+        std::uint32_t t = (x[0] ^ x[d]) & p;
+        x[0] ^= t;
+        x[d] ^= t;
+      }
+    }
+  }
+
+  // Gray encode
+  x[1] ^= x[0];
+  x[2] ^= x[1];
+  std::uint32_t t = 0;
+  for (std::uint32_t q = m; q > 1; q >>= 1) {
+    if (x[2] & q) { t ^= q - 1; }
+  }
+  for (int d=0; d<3; ++d) { x[d] ^= t; }
+
+  // Interleave transposed bits, most significant first
+  std::uint64_t code = 0;
+  for (int b=bits-1; b>=0; --b) {
+    for (int d=0; d<3; ++d) {
+      code = (code << 1) | ((x[d] >> b) & 1);
+    }
+  }
+  return code;
+}
+
+// Indices of all cells in a cube of a given size sorted by Z-order.
+inline std::vector<yapl::cube_index> morton_sequence(const yapl::cube_index & size)
+{
+  std::vector<yapl::cube_index> seq;
+  seq.reserve(size.volume());
+  for (size_t z=0; z<size.get<2>(); ++z) {
+    for (size_t y=0; y<size.get<1>(); ++y) {
+      for (size_t x=0; x<size.get<0>(); ++x) {
+        seq.push_back(yapl::cube_index{x,y,z});
+      }
+    }
+  }
+  std::sort(seq.begin(), seq.end(),
+    [](const yapl::cube_index & a, const yapl::cube_index & b) {
+      return morton_code(a) < morton_code(b);
+    });
+  return seq;
+}
+
+}
+
+#endif
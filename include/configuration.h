@@ -0,0 +1,142 @@
+#ifndef FLUID_CONFIGURATION_H
+#define FLUID_CONFIGURATION_H
+
+#include "policy.h"
+
+// Simulation options selected by the definitions of the build
+// (ENABLE_* flags and values set by CMake options).
+namespace fluid {
+namespace configuration {
+
+#ifdef ENABLE_DOUBLE_PRECISION
+using data_type = double;
+#else
+using data_type = float;
+#endif
+
+#ifdef ENABLE_CFL_CHECK
+constexpr bool cfl_check = true;
+#else
+constexpr bool cfl_check = false;
+#endif
+
+#ifdef ENABLE_SOA_LAYOUT
+template <typename T>
+using storage_type = soa_storage<T>;
+#elif defined(ENABLE_FP16_COLD_FIELDS)
+template <typename T>
+using storage_type = fp16_storage<T>;
+#elif defined(ENABLE_BF16_COLD_FIELDS)
+template <typename T>
+using storage_type = bf16_storage<T>;
+#else
+template <typename T>
+using storage_type = aos_storage<T>;
+#endif
+
+#ifdef ENABLE_CONTIGUOUS_GRID
+constexpr grid_layout layout = grid_layout::contiguous;
+#elif defined(ENABLE_MIGRATING_GRID)
+constexpr grid_layout layout = grid_layout::migrating;
+#else
+constexpr grid_layout layout = grid_layout::cells;
+#endif
+
+#ifdef ENABLE_MORTON_ORDER
+constexpr cell_order order = cell_order::morton;
+#else
+constexpr cell_order order = cell_order::linear;
+#endif
+
+#ifdef ENABLE_SIMD_KERNELS
+constexpr kernel_mode kernel = kernel_mode::simd;
+#elif defined(ENABLE_VERLET_LISTS)
+constexpr kernel_mode kernel = kernel_mode::verlet;
+#elif defined(ENABLE_GATHER_FORCES)
+constexpr kernel_mode kernel = kernel_mode::gather;
+#else
+constexpr kernel_mode kernel = kernel_mode::pairwise;
+#endif
+
+#ifdef ENABLE_CELL_COLOURING
+constexpr cell_scheduling scheduling = cell_scheduling::coloured;
+#elif defined(ENABLE_BUFFERED_FORCES)
+constexpr cell_scheduling scheduling = cell_scheduling::buffered;
+#else
+constexpr cell_scheduling scheduling = cell_scheduling::locked;
+#endif
+
+#ifdef ENABLE_WAVEFRONT_PHASES
+constexpr frame_phases phases = frame_phases::wavefront;
+#elif defined(ENABLE_FRAME_GRAPH)
+constexpr frame_phases phases = frame_phases::graph;
+#elif defined(ENABLE_FUSED_PHASES)
+constexpr frame_phases phases = frame_phases::fused;
+#else
+constexpr frame_phases phases = frame_phases::separate;
+#endif
+
+#ifdef ENABLE_RSQRT_MATH
+using math_type = rsqrt_math;
+#elif defined(ENABLE_RECIPROCAL_MATH)
+using math_type = reciprocal_math;
+#else
+using math_type = exact_math;
+#endif
+
+#ifdef REORDER_INTERVAL
+constexpr int reorder_interval = REORDER_INTERVAL;
+#else
+constexpr int reorder_interval = 0;
+#endif
+
+#ifdef VERLET_SKIN
+constexpr data_type verlet_skin = VERLET_SKIN;
+#else
+constexpr data_type verlet_skin = 0;
+#endif
+
+#ifdef TRAJECTORY_INTERVAL
+constexpr int trajectory_interval = TRAJECTORY_INTERVAL;
+#else
+constexpr int trajectory_interval = 0;
+#endif
+
+#ifdef TRAJECTORY_BACKLOG
+constexpr int trajectory_backlog = TRAJECTORY_BACKLOG;
+#else
+constexpr int trajectory_backlog = 2;
+#endif
+
+#ifdef ENABLE_COMPACT_TRAJECTORY
+constexpr bool compact_trajectory = true;
+#else
+constexpr bool compact_trajectory = false;
+#endif
+
+#ifdef TRAJECTORY_POSITION_BITS
+constexpr unsigned int trajectory_position_bits = TRAJECTORY_POSITION_BITS;
+#else
+constexpr unsigned int trajectory_position_bits = 12;
+#endif
+
+#ifdef TRAJECTORY_VELOCITY_BITS
+constexpr unsigned int trajectory_velocity_bits = TRAJECTORY_VELOCITY_BITS;
+#else
+constexpr unsigned int trajectory_velocity_bits = 10;
+#endif
+
+}
+
+// Execution policy E (sequential_policy or tbb_policy) with the options
+// of the build
+template <template <typename, bool, template <typename> class, grid_layout, cell_order,
+                    kernel_mode, cell_scheduling, frame_phases, typename> class E>
+using configured_policy = E<configuration::data_type, configuration::cfl_check,
+    configuration::storage_type, configuration::layout, configuration::order,
+    configuration::kernel, configuration::scheduling, configuration::phases,
+    configuration::math_type>;
+
+}
+
+#endif
@@ -17,6 +17,13 @@ public:
 
   yapl::cube_index grid_position(const space_vector<T> & p) const;
 
+  size_t cell_number(const yapl::cube_index & i) const;
+  yapl::cube_index cell_index(size_t n) const;
+
+  // Walls touched by a cell: bit 2D for the lower and bit 2D+1 for the
+  // upper wall of dimension D
+  unsigned walls(const yapl::cube_index & i) const;
+
   const yapl::cube_index size_;
   const size_t num_cells_;
   const space_vector<T> delta_;
@@ -48,6 +55,29 @@ yapl::cube_index domain<T>::grid_position(const space_vector<T> & p) const
   return size_.box(i);
 }
 
+// Linear number of a cell (x varying fastest)
+template <typename T>
+size_t domain<T>::cell_number(const yapl::cube_index & i) const
+{
+  return (i.get<2>() * size_.get<1>() + i.get<1>()) * size_.get<0>() + i.get<0>();
+}
+
+template <typename T>
+yapl::cube_index domain<T>::cell_index(size_t n) const
+{
+  const size_t nx = size_.get<0>();
+  const size_t ny = size_.get<1>();
+  return yapl::cube_index{n % nx, (n / nx) % ny, n / (nx * ny)};
+}
+
+template <typename T>
+unsigned domain<T>::walls(const yapl::cube_index & i) const
+{
+  return unsigned{i.get<0>() == 0} | unsigned{i.get<0>() == upper_index<0>()} << 1 |
+         unsigned{i.get<1>() == 0} << 2 | unsigned{i.get<1>() == upper_index<1>()} << 3 |
+         unsigned{i.get<2>() == 0} << 4 | unsigned{i.get<2>() == upper_index<2>()} << 5;
+}
+
 }
 
 #endif
@@ -0,0 +1,138 @@
+#ifndef FLUID_EXECUTION_H
+#define FLUID_EXECUTION_H
+
+#include <tbb/tbb.h>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace fluid {
+
+// Non-atomic replacement for std::atomic for sequential executions.
+template <typename U>
+class null_atomic {
+public:
+  null_atomic() = default;
+
+  null_atomic(const null_atomic &) = delete;
+  null_atomic & operator=(const null_atomic &) = delete;
+
+  U load(std::memory_order = std::memory_order_seq_cst) const { return value_; }
+  void store(U v, std::memory_order = std::memory_order_seq_cst) { value_ = v; }
+  U fetch_add(U v, std::memory_order = std::memory_order_seq_cst) {
+    U old = value_;
+    value_ += v;
+    return old;
+  }
+
+private:
+  U value_;
+};
+
+// Single instance of U for sequential executions, with the part of the
+// interface of tbb::enumerable_thread_specific used by the grid.
+template <typename U>
+class single_instance {
+public:
+  U & local() { return value_; }
+  U * begin() { return &value_; }
+  U * end() { return &value_ + 1; }
+
+private:
+  U value_{};
+};
+
+// Tasks with dependencies, built once and run any number of times.
+// Nodes run in the order they were added, which must list every node
+// after its predecessors.
+class sequential_task_graph {
+public:
+  template <typename F>
+  std::size_t add_node(F f) {
+    tasks_.emplace_back(f);
+    return tasks_.size() - 1;
+  }
+
+  void add_edge(std::size_t, std::size_t) {}
+
+  void run() {
+    for (auto && t : tasks_) { t(); }
+  }
+
+private:
+  std::vector<std::function<void()>> tasks_;
+};
+
+// Tasks with dependencies as a TBB flow graph. A node starts as soon as
+// all its predecessors have finished.
+class tbb_task_graph {
+public:
+  using node_type = tbb::flow::continue_node<tbb::flow::continue_msg>;
+
+  template <typename F>
+  std::size_t add_node(F f) {
+    nodes_.emplace_back(new node_type{graph_, [f](const tbb::flow::continue_msg &) {
+      f();
+      return tbb::flow::continue_msg{};
+    }});
+    roots_.push_back(true);
+    return nodes_.size() - 1;
+  }
+
+  void add_edge(std::size_t from, std::size_t to) {
+    tbb::flow::make_edge(*nodes_[from], *nodes_[to]);
+    roots_[to] = false;
+  }
+
+  void run() {
+    for (std::size_t k=0; k<nodes_.size(); ++k) {
+      if (roots_[k]) { nodes_[k]->try_put(tbb::flow::continue_msg{}); }
+    }
+    graph_.wait_for_all();
+  }
+
+private:
+  tbb::flow::graph graph_;
+  std::vector<std::unique_ptr<node_type>> nodes_;
+  std::vector<bool> roots_;
+};
+
+// Loops over index ranges that are not cells of a cube.
+struct sequential_execution {
+  template <typename U>
+  using atomic = null_atomic<U>;
+
+  template <typename U>
+  using per_thread = single_instance<U>;
+
+  using task_graph = sequential_task_graph;
+
+  template <typename F>
+  static void for_range(std::size_t first, std::size_t last, F f) {
+    for (std::size_t i=first; i<last; ++i) { f(i); }
+  }
+};
+
+struct tbb_execution {
+  template <typename U>
+  using atomic = std::atomic<U>;
+
+  template <typename U>
+  using per_thread = tbb::enumerable_thread_specific<U>;
+
+  using task_graph = tbb_task_graph;
+
+  template <typename F>
+  static void for_range(std::size_t first, std::size_t last, F f) {
+    tbb::parallel_for(tbb::blocked_range<std::size_t>{first,last},
+      [&f](const tbb::blocked_range<std::size_t> & r) {
+        for (std::size_t i=r.begin(); i!=r.end(); ++i) { f(i); }
+      });
+  }
+};
+
+}
+
+#endif
@@ -6,18 +6,22 @@
 #include "cell.h"
 #include "simulation_stream.h"
 #include "policy.h"
+#include "simd_kernels.h"
 #include <yapl/cube.h>
 #include <yapl/algorithm.h>
 #include <iostream>
 #include <algorithm>
 #include <numeric>
+#include <stdexcept>
+#include <functional>
 
 namespace fluid {
 
 template <typename T, typename P>
 class grid {
 public:
-  grid(T ppm);
+  // skin: extra radius of neighbour lists as a fraction of h
+  grid(T ppm, T skin = 0);
 
   grid(const grid & g) = delete;
   grid & operator=(const grid &) = delete;
@@ -26,99 +30,874 @@ public:
   grid & operator=(grid && g) = delete;
 
   size_t num_cells() const { return domain_.num_cells_; }
+  const domain<T> & cell_domain() const { return domain_; }
 
   void rebuild_grid();
   void compute_forces();
   void process_collisions();
   void reprocess_collisions();
   void advance_particles();
+  void reorder_particles();
+
+  // Fused phases: process_collisions, advance_particles and
+  // reprocess_collisions in a single sweep, which also finds the next
+  // cells of particles for the following rebuild where the layout allows.
+  void integrate();
+
+  // Graph phases: compute_forces and integrate as a graph of tasks per
+  // block of cells
+  void run_frame_graph();
 
   void get_statistics(float & m, float & d, size_t & nempty) const;
+  size_t num_list_builds() const { return list_builds_; }
+  size_t num_allocations() const { return allocations_.load(); }
 
   void read(simulation_istream & is, size_t np);
   void write(simulation_ostream & os) const;
 
+  // Stores all particles to values in file order
+  void encode(float * values) const;
+
 private:
 
-  template <int I>
-  void do_process_collisions_lower();
+  using cell_type = typename P::cell_type;
+  using particle_type = typename cell_type::particle_type;
+  using grid_policy = typename P::grid_policy;
+  using cube_type = yapl::cube<cell_type, grid_policy>;
+  using execution = typename P::execution;
+  using storage_type = typename P::storage_type;
+  using counter_type = typename execution::template atomic<size_t>;
+  using math = typename P::math;
+
+  template <grid_layout L>
+  using layout_tag = std::integral_constant<grid_layout, L>;
+
+  template <kernel_mode K>
+  using kernel_tag = std::integral_constant<kernel_mode, K>;
+
+  // Coloured scheduling never runs neighbour cells at the same time.
+  // Kernels other than pairwise lock cells under buffered scheduling.
+  static constexpr bool lock_cells = P::scheduling != cell_scheduling::coloured;
+
+  static constexpr bool graph_phases =
+      P::phases == frame_phases::graph || P::phases == frame_phases::wavefront;
+
+  static_assert(!graph_phases || P::scheduling == cell_scheduling::locked,
+      "Graph phases schedule blocks of cells themselves and require locked cells");
+
+  // Gathering completes the densities of a cell in a single task, which
+  // then transforms them. Other kernels add to neighbour cells until the
+  // end of the pass.
+  static constexpr bool fused_transform =
+      P::phases == frame_phases::fused && P::kernel == kernel_mode::gather;
+
+  // Buffered scheduling: contributions of a group of cells to the
+  // particles of a neighbour cell, stored from values[first] on.
+  struct contribution_segment {
+    cell_type * target;
+    size_t group;
+    size_t first;
+  };
+
+  template <typename V>
+  struct contribution_buffer {
+    std::vector<V> values;
+    std::vector<contribution_segment> segments;
+  };
+
+  template <typename V>
+  using buffer_set = typename execution::template per_thread<contribution_buffer<V>>;
+
+  template <typename V, typename F, typename G, typename A>
+  void buffered_pass(buffer_set<V> & buffers, const V & zero, F f, G g, A add);
+
+  template <typename G>
+  void increase_densities(kernel_tag<kernel_mode::pairwise>, G groups);
+  template <typename G>
+  void increase_densities(kernel_tag<kernel_mode::simd>, G groups);
+  template <typename G>
+  void transfer_accelerations(kernel_tag<kernel_mode::pairwise>, G groups);
+  template <typename G>
+  void transfer_accelerations(kernel_tag<kernel_mode::simd>, G groups);
+  template <typename G>
+  void increase_densities(kernel_tag<kernel_mode::verlet>, G groups);
+  template <typename G>
+  void transfer_accelerations(kernel_tag<kernel_mode::verlet>, G groups);
+  template <typename G>
+  void increase_densities(kernel_tag<kernel_mode::gather>, G groups);
+  template <typename G>
+  void transfer_accelerations(kernel_tag<kernel_mode::gather>, G groups);
+
+  void build_neighbour_lists();
+  bool moved_beyond_skin();
+
+  // Cells of the migrating layout own their particles as in the cells layout
+  static constexpr grid_layout storage_layout =
+      (P::layout == grid_layout::contiguous) ? grid_layout::contiguous : grid_layout::cells;
+
+  void rebuild_grid(layout_tag<grid_layout::cells>);
+  void rebuild_grid(layout_tag<grid_layout::contiguous>);
+  void rebuild_grid(layout_tag<grid_layout::migrating>);
+
+  // Calls f(i, position, hv, velocity) for particle i of the next np
+  // particles of is, in parallel over chunks of particles
+  template <typename F>
+  void for_all_read_particles(const simulation_istream & is, size_t np, F f);
+  void read(simulation_istream & is, size_t np, layout_tag<grid_layout::cells>);
+  template <typename S, typename D>
+  size_t encode_blocks(S store, D done) const;
+  void read(simulation_istream & is, size_t np, layout_tag<grid_layout::contiguous>);
+
+  void reorder_particles(layout_tag<grid_layout::cells>);
+  void reorder_particles(layout_tag<grid_layout::contiguous>);
+
+  void sort_particles();
+  void count_particle(size_t i, const cell_type & c);
+  void assign_cell_ranges();
+
+  bool migrate_particle(cell_type & c, particle_type & p);
+  void add_migrants(layout_tag<grid_layout::cells>) {}
+  void add_migrants(layout_tag<grid_layout::contiguous>) {}
+  void add_migrants(layout_tag<grid_layout::migrating>);
+
+  void begin_integration();
+  void end_integration();
+  void integrate(particle_type & p, unsigned walls);
+  void integrate(cell_type & c, size_t n, layout_tag<grid_layout::cells>);
+  void integrate(cell_type & c, size_t n, layout_tag<grid_layout::contiguous>);
+  void integrate(cell_type & c, size_t n, layout_tag<grid_layout::migrating>);
+
+  std::uint64_t particle_key(const particle_type & p) const;
+
+  template <typename F>
+  void for_all_cells(cube_type & cube, F f);
+
+  template <typename F>
+  void for_all_cell_groups(F f);
 
-  template <int I>
-  void do_reprocess_collisions_upper();
+  template <typename F>
+  void for_block_groups(size_t b, F f);
 
-  template <int I>
-  void do_reprocess_collisions_lower();
+  // Groups of cells passed to kernels: all of them, scheduled as the
+  // policy says, or those of a block of cells, one after the other
+  struct all_groups {
+    grid * g;
+    template <typename F>
+    void operator()(F f) const { g->for_all_cell_groups(f); }
+  };
 
-  template <int I>
-  void do_process_collisions_upper();
+  struct block_groups {
+    grid * g;
+    size_t b;
+    template <typename F>
+    void operator()(F f) const { g->for_block_groups(b, f); }
+  };
+
+  void build_cell_pairs();
+  void filter_cell_pairs();
+  void sort_groups_by_colour();
+  void sort_groups_by_block();
+  void build_frame_graph();
+
+  size_t cell_key(const yapl::cube_index & i) const;
+  yapl::cube_index key_cell(size_t k) const;
+
+  void process_collisions(particle_type & p, unsigned walls);
+  void reprocess_collisions(particle_type & p, unsigned walls);
+
+  template <typename F>
+  void for_all_boundary_cells(F f);
 
 private:
 
   const params<T> params_;
   const domain<T> domain_;
 
-  using cell_type = typename P::cell_type;
-  using grid_policy = typename P::grid_policy;
-  using cube_type = yapl::cube<cell_type, grid_policy>;
-
   cube_type cells_;
-  cube_type cells2_;
+  cube_type cells2_; // Empty unless particles are copied between cubes
+
+  // Pairs (cell, neighbour) of cell numbers grouped by cell in traversal
+  // order. Every group starts with the cell paired with itself. Numbers
+  // refer to cells_ and cells2_ alike. Gathering needs all neighbours,
+  // otherwise every pair of neighbours appears once.
+  using cell_pair = std::pair<std::uint32_t,std::uint32_t>;
+  static constexpr bool all_neighbours = P::kernel == kernel_mode::gather;
+  static constexpr size_t max_neighbours = all_neighbours ? 26 : 13;
+  std::vector<cell_pair> cell_pairs_;
+
+  // Refreshed every frame: every cell of cells_ by number (null if empty),
+  // groups of pairs of non empty cells as a cell followed by its neighbours,
+  // and the start of every group followed by the end of the last one.
+  std::vector<cell_type*> cell_ptrs_;
+  std::vector<cell_type*> active_cells_;
+  std::vector<size_t> active_groups_;
+
+  // Coloured scheduling: colour of every cell number, so that cells of a
+  // colour are at least 3 cells apart along some axis, and groups sorted
+  // by colour with the first group of every colour.
+  static constexpr size_t num_colours = 27;
+  std::vector<std::uint8_t> cell_colours_;
+  std::vector<std::uint8_t> group_colours_;
+  std::vector<size_t> colour_groups_;
+  std::vector<size_t> colour_offsets_;
+
+  // Numbers of the cells touching walls of the domain with the walls they
+  // touch, as bits of domain::walls
+  std::vector<std::pair<std::uint32_t,std::uint8_t>> boundary_cells_;
+
+  // Graph phases: blocks of block_width^2 x block_depth cells, the block
+  // of every cell number, the cell number of every group, and groups
+  // sorted by block with the first group of every block. Refreshed every
+  // frame but the block numbers and the graph. Wavefront blocks are as
+  // large as graph blocks, but one cell thick.
+  static constexpr bool thin_blocks = P::phases == frame_phases::wavefront;
+  static constexpr size_t block_width = thin_blocks ? 8 : 4;
+  static constexpr size_t block_depth = thin_blocks ? 1 : 4;
+  size_t num_blocks_;
+  std::vector<std::uint32_t> cell_blocks_;
+  std::vector<std::uint32_t> group_cells_;
+  std::vector<size_t> block_groups_;
+  std::vector<size_t> block_offsets_;
+  typename execution::task_graph frame_graph_;
+
+  buffer_set<T> density_buffers_;
+  buffer_set<space_vector<T>> acceleration_buffers_;
+
+  // Contiguous layout: particles sorted by cell key and
+  // cell key of every particle.
+  storage_type particles_;
+  storage_type particles2_;
+  std::vector<size_t> particle_cells_;
+  std::vector<size_t> particle_cells2_;
+  std::vector<counter_type> cell_counts_;
+  std::vector<size_t> cell_offsets_;
+
+  // Morton order: cell indices in traversal order and
+  // position in traversal of every cell number.
+  std::vector<yapl::cube_index> cell_sequence_;
+  std::vector<size_t> cell_ranks_;
+
+  // SIMD kernels for the instruction set selected at run time
+  typename simd_kernels<T>::density_function density_kernel_;
+  typename simd_kernels<T>::force_function force_kernel_;
+
+  // Verlet lists: squared list radius (h+skin) and squared half skin.
+  // Lists stay valid while no particle moved more than half the skin.
+  const T list_radius_sq_;
+  const T max_displacement_sq_;
+  bool lists_valid_;
+  size_t list_builds_;
+
+  // Growths of cell storages in the last rebuild
+  counter_type allocations_;
+
+  // Migrating layout: particles leaving their cell in the current rebuild
+  struct migrant {
+    cell_type * target;
+    space_vector<T> position;
+    space_vector<T> hv;
+    space_vector<T> velocity;
+  };
+  typename execution::template per_thread<std::vector<migrant>> migrants_;
+
+  // Reordering: keys and copies of the particles of a cell, kept per
+  // thread so that their buffers are reused by every cell and reorder
+  typename execution::template per_thread<std::vector<std::pair<std::uint64_t,size_t>>> reorder_keys_;
+  typename execution::template per_thread<storage_type> reorder_scratch_;
+
+  // Fused phases already counted (contiguous) or moved (migrating) the
+  // particles for the next rebuild
+  bool next_cells_found_;
 };
 
 
 template <typename T, typename P>
-grid<T,P>::grid(T ppm)
+grid<T,P>::grid(T ppm, T skin)
 :
 params_{ppm},
-domain_{params_.h_},
+domain_{params_.h_ + skin * params_.h_},
 
 cells_{domain_.size_},
-cells2_{domain_.size_}
+cells2_{(P::layout == grid_layout::cells) ? domain_.size_ : yapl::cube_index{0,0,0}},
+cell_pairs_{},
+cell_ptrs_(domain_.num_cells_),
+active_cells_{},
+active_groups_(1, 0),
+cell_colours_{},
+group_colours_{},
+colour_groups_{},
+colour_offsets_(num_colours + 1, 0),
+boundary_cells_{},
+num_blocks_{0},
+cell_blocks_{},
+group_cells_{},
+block_groups_{},
+block_offsets_{},
+frame_graph_{},
+density_buffers_{},
+acceleration_buffers_{},
+particles_{},
+particles2_{},
+particle_cells_{},
+particle_cells2_{},
+cell_counts_(P::layout==grid_layout::contiguous ? domain_.num_cells_ : 0),
+cell_offsets_(P::layout==grid_layout::contiguous ? domain_.num_cells_ + 1 : 0),
+cell_sequence_{},
+cell_ranks_{},
+density_kernel_{simd_kernels<T>::density(select_instruction_set())},
+force_kernel_{simd_kernels<T>::force(select_instruction_set())},
+list_radius_sq_{(params_.h_ + skin * params_.h_) * (params_.h_ + skin * params_.h_)},
+max_displacement_sq_{(skin * params_.h_ / 2) * (skin * params_.h_ / 2)},
+lists_valid_{false},
+list_builds_{0},
+allocations_{},
+migrants_{},
+reorder_keys_{},
+reorder_scratch_{},
+next_cells_found_{false}
 {
-  yapl::apply_indexed(cells_.all(), [this](cell_type & c, const yapl::cube_index & i) {
+  // Cells are at least h+skin wide, so that particles staying in their
+  // cells do not come closer than h to particles of non neighbour cells.
+  if ((P::kernel == kernel_mode::verlet) != (skin > 0)) {
+    throw std::invalid_argument("Skin must be positive with Verlet lists only");
+  }
+
+  if (P::order == cell_order::morton) {
+    cell_sequence_ = morton_sequence(domain_.size_);
+    cell_ranks_.resize(domain_.num_cells_);
+    for (size_t k=0; k<cell_sequence_.size(); ++k) {
+      cell_ranks_[domain_.cell_number(cell_sequence_[k])] = k;
+    }
+  }
+
+  yapl::apply_indexed(cells_.all(), [](cell_type & c, const yapl::cube_index & i) {
     c.set_index(i);
-    cells_.for_all_neighbours_unique(i, [&c](cell_type & nc) {
-      c.add_neighbour(nc);
-    });
   });
-  yapl::apply_indexed(cells2_.all(), [this](cell_type & c, const yapl::cube_index & i) {
+  yapl::apply_indexed(cells2_.all(), [](cell_type & c, const yapl::cube_index & i) {
     c.set_index(i);
-    cells2_.for_all_neighbours_unique(i, [&c](cell_type & nc) {
-      c.add_neighbour(nc);
+  });
+
+  build_cell_pairs();
+  if (graph_phases) {
+    build_frame_graph();
+  }
+}
+
+template <typename T, typename P>
+void grid<T,P>::build_cell_pairs()
+{
+  using number_cube = yapl::cube<std::uint32_t, yapl::default_policy<std::uint32_t>>;
+  number_cube numbers{domain_.size_};
+  yapl::apply_indexed(numbers.all(), [this](std::uint32_t & n, const yapl::cube_index & i) {
+    n = domain_.cell_number(i);
+  });
+
+  std::vector<std::vector<std::uint32_t>> near(domain_.num_cells_);
+  yapl::apply_indexed(numbers.all_ordered(), [&numbers,&near](std::uint32_t n, const yapl::cube_index & i) {
+    numbers.for_all_neighbours_unique(i, [&near,n](std::uint32_t m) {
+      near[n].push_back(m);
+      if (all_neighbours) near[m].push_back(n);
     });
   });
+
+  cell_pairs_.reserve(domain_.num_cells_ * (max_neighbours + 1));
+  for (size_t k=0; k<domain_.num_cells_; ++k) {
+    const std::uint32_t n = numbers(key_cell(k));
+    cell_pairs_.emplace_back(n, n);
+    for (auto m : near[n]) {
+      cell_pairs_.emplace_back(n, m);
+    }
+  }
+
+  for (size_t n=0; n<domain_.num_cells_; ++n) {
+    const unsigned walls = domain_.walls(domain_.cell_index(n));
+    if (walls != 0) {
+      boundary_cells_.emplace_back(n, walls);
+    }
+  }
+
+  if (P::scheduling == cell_scheduling::coloured) {
+    cell_colours_.resize(domain_.num_cells_);
+    for (size_t n=0; n<domain_.num_cells_; ++n) {
+      const yapl::cube_index i = domain_.cell_index(n);
+      cell_colours_[n] = i.get<0>() % 3 + 3 * (i.get<1>() % 3) + 9 * (i.get<2>() % 3);
+    }
+  }
+}
+
+// Keeps pairs of non empty cells of cells_
+template <typename T, typename P>
+void grid<T,P>::filter_cell_pairs()
+{
+  yapl::apply_indexed(cells_.all(), [this](cell_type & c, const yapl::cube_index & i) {
+    cell_ptrs_[domain_.cell_number(i)] = (c.num_particles() > 0) ? &c : nullptr;
+  });
+
+  active_cells_.clear();
+  active_groups_.clear();
+  group_colours_.clear();
+  group_cells_.clear();
+  for (auto && cp : cell_pairs_) {
+    cell_type * c = cell_ptrs_[cp.first];
+    cell_type * nc = cell_ptrs_[cp.second];
+    if (c == nullptr || nc == nullptr) continue;
+    if (c == nc) {
+      active_groups_.push_back(active_cells_.size());
+      if (P::scheduling == cell_scheduling::coloured) {
+        group_colours_.push_back(cell_colours_[cp.first]);
+      }
+      if (graph_phases) {
+        group_cells_.push_back(cp.first);
+      }
+    }
+    active_cells_.push_back(nc);
+  }
+  active_groups_.push_back(active_cells_.size());
+
+  if (P::scheduling == cell_scheduling::coloured) {
+    sort_groups_by_colour();
+  }
+  if (graph_phases) {
+    sort_groups_by_block();
+  }
+}
+
+// Counting sort of groups by colour, keeping traversal order within a colour
+template <typename T, typename P>
+void grid<T,P>::sort_groups_by_colour()
+{
+  const size_t ngroups = group_colours_.size();
+  std::fill(colour_offsets_.begin(), colour_offsets_.end(), 0);
+  for (auto c : group_colours_) {
+    ++colour_offsets_[c + 1];
+  }
+  std::partial_sum(colour_offsets_.begin(), colour_offsets_.end(), colour_offsets_.begin());
+
+  std::vector<size_t> next(colour_offsets_.begin(), colour_offsets_.end() - 1);
+  colour_groups_.resize(ngroups);
+  for (size_t g=0; g<ngroups; ++g) {
+    colour_groups_[next[group_colours_[g]]++] = g;
+  }
+}
+
+// Counting sort of groups by block, keeping traversal order within a block
+template <typename T, typename P>
+void grid<T,P>::sort_groups_by_block()
+{
+  const size_t ngroups = group_cells_.size();
+  std::fill(block_offsets_.begin(), block_offsets_.end(), 0);
+  for (auto n : group_cells_) {
+    ++block_offsets_[cell_blocks_[n] + 1];
+  }
+  std::partial_sum(block_offsets_.begin(), block_offsets_.end(), block_offsets_.begin());
+
+  std::vector<size_t> next(block_offsets_.begin(), block_offsets_.end() - 1);
+  block_groups_.resize(ngroups);
+  for (size_t g=0; g<ngroups; ++g) {
+    block_groups_[next[cell_blocks_[group_cells_[g]]]++] = g;
+  }
+}
+
+// Tasks of a block b, in this order: densities of the groups of b,
+// transformation of the densities of b, accelerations of the groups of b,
+// and integration of b. Groups of b write to cells of b and its
+// neighbour blocks only. Thus every task of b depends on the previous
+// task of b and of its neighbour blocks.
+//
+// Tasks are added slab of blocks by slab along z, each phase lagging
+// behind the previous one: by all slabs for graph phases, so that a
+// sequential graph runs one phase after the other, and by a single slab
+// for wavefront phases, so that it runs a phase of a slab right after
+// the slab it depends on.
+template <typename T, typename P>
+void grid<T,P>::build_frame_graph()
+{
+  const yapl::cube_index & size = domain_.size_;
+  const size_t bx = (size.get<0>() + block_width - 1) / block_width;
+  const size_t by = (size.get<1>() + block_width - 1) / block_width;
+  const size_t bz = (size.get<2>() + block_depth - 1) / block_depth;
+  num_blocks_ = bx * by * bz;
+  block_offsets_.resize(num_blocks_ + 1);
+
+  cell_blocks_.resize(domain_.num_cells_);
+  for (size_t n=0; n<domain_.num_cells_; ++n) {
+    const yapl::cube_index i = domain_.cell_index(n);
+    cell_blocks_[n] = (i.get<2>() / block_depth * by + i.get<1>() / block_width) * bx
+                    + i.get<0>() / block_width;
+  }
+
+  std::vector<size_t> densities(num_blocks_), transforms(num_blocks_),
+                      forces(num_blocks_), moves(num_blocks_);
+  auto add_tasks = [this,&densities,&transforms,&forces,&moves](size_t phase, size_t b) {
+    switch (phase) {
+      case 0:
+        densities[b] = frame_graph_.add_node([this,b]() {
+          increase_densities(kernel_tag<P::kernel>{}, block_groups{this, b});
+        });
+        break;
+      case 1:
+        transforms[b] = frame_graph_.add_node([this,b]() {
+          for_block_groups(b, [this](cell_type & c, cell_type **, cell_type **) {
+            c.for_all_particles([this](particle_type & p) {
+              p.transform_density(params_.density_coeff_,params_.h6_);
+            });
+          });
+        });
+        break;
+      case 2:
+        forces[b] = frame_graph_.add_node([this,b]() {
+          transfer_accelerations(kernel_tag<P::kernel>{}, block_groups{this, b});
+        });
+        break;
+      default:
+        moves[b] = frame_graph_.add_node([this,b]() {
+          for (size_t k=block_offsets_[b]; k<block_offsets_[b+1]; ++k) {
+            const size_t g = block_groups_[k];
+            integrate(*active_cells_[active_groups_[g]], group_cells_[g], layout_tag<P::layout>{});
+          }
+        });
+    }
+  };
+
+  const size_t lag = (P::phases == frame_phases::wavefront) ? 1 : bz;
+  for (size_t s=0; s<bz+3*lag; ++s) {
+    for (size_t phase=0; phase<4; ++phase) {
+      if (s < phase * lag || s - phase * lag >= bz) continue;
+      const size_t z = s - phase * lag;
+      for (size_t b=z*bx*by; b<(z+1)*bx*by; ++b) {
+        add_tasks(phase, b);
+      }
+    }
+  }
+
+  for (size_t z=0; z<bz; ++z) {
+    for (size_t y=0; y<by; ++y) {
+      for (size_t x=0; x<bx; ++x) {
+        const size_t b = (z * by + y) * bx + x;
+        for (size_t nz=(z>0 ? z-1 : 0); nz<=std::min(z+1, bz-1); ++nz) {
+          for (size_t ny=(y>0 ? y-1 : 0); ny<=std::min(y+1, by-1); ++ny) {
+            for (size_t nx=(x>0 ? x-1 : 0); nx<=std::min(x+1, bx-1); ++nx) {
+              const size_t nb = (nz * by + ny) * bx + nx;
+              frame_graph_.add_edge(densities[nb], transforms[b]);
+              frame_graph_.add_edge(transforms[nb], forces[b]);
+              frame_graph_.add_edge(forces[nb], moves[b]);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// Applies f(c, first, last) to the groups of block b in traversal order
+template <typename T, typename P>
+template <typename F>
+void grid<T,P>::for_block_groups(size_t b, F f)
+{
+  for (size_t k=block_offsets_[b]; k<block_offsets_[b+1]; ++k) {
+    const size_t g = block_groups_[k];
+    cell_type ** first = active_cells_.data() + active_groups_[g];
+    cell_type ** last = active_cells_.data() + active_groups_[g+1];
+    f(**first, first + 1, last);
+  }
+}
+
+// Applies f(c, first, last) to every non empty cell c and the range
+// [first,last) of pointers to its non empty neighbours
+template <typename T, typename P>
+template <typename F>
+void grid<T,P>::for_all_cell_groups(F f)
+{
+  auto apply_group = [this,&f](size_t g) {
+    cell_type ** first = active_cells_.data() + active_groups_[g];
+    cell_type ** last = active_cells_.data() + active_groups_[g+1];
+    f(**first, first + 1, last);
+  };
+
+  if (P::scheduling == cell_scheduling::coloured) {
+    for (size_t c=0; c<num_colours; ++c) {
+      execution::for_range(colour_offsets_[c], colour_offsets_[c+1], [this,&apply_group](size_t k) {
+        apply_group(colour_groups_[k]);
+      });
+    }
+  }
+  else {
+    execution::for_range(0, active_groups_.size() - 1, apply_group);
+  }
 }
 
 template <typename T, typename P>
 void grid<T,P>::rebuild_grid()
+{
+  allocations_.store(0);
+
+  // Particles stay in their cells while neighbour lists are valid
+  if (P::kernel == kernel_mode::verlet) {
+    if (lists_valid_ && !moved_beyond_skin()) {
+      for_all_cells(cells_, [](cell_type & c) {
+        c.for_all_particles([](particle_type & p) {
+          p.clear_forces();
+        });
+      });
+      return;
+    }
+    lists_valid_ = false;
+  }
+  rebuild_grid(layout_tag<P::layout>{});
+  filter_cell_pairs();
+}
+
+template <typename T, typename P>
+void grid<T,P>::rebuild_grid(layout_tag<grid_layout::cells>)
 {
   //swap src and dest arrays with particles
   yapl::swap(cells_,cells2_);
 
-  yapl::apply(cells_.all(), [](cell_type & c) {
+  for_all_cells(cells_, [](cell_type & c) {
     c.clear_particles();
   });
 
   // Reposition particles in corresponding cell
-  yapl::apply(cells2_.all(), [this](const cell_type & vc) {
-    vc.for_all_particles([this,&vc](const particle<T> & p) {
+  for_all_cells(cells2_, [this](const cell_type & vc) {
+    vc.for_all_particles([this,&vc](const particle_type & p) {
       auto i = p.grid_position(domain_);
       vc.check(i);
-      cells_(i).add_particle(p);
+      if (cells_(i).add_particle(p)) {
+        allocations_.fetch_add(1, std::memory_order_relaxed);
+      }
     });
  });
 }
 
+// Particles staying in their cell are left in place. The others are
+// moved out to per thread lists and then added to their new cells.
+template <typename T, typename P>
+void grid<T,P>::rebuild_grid(layout_tag<grid_layout::migrating>)
+{
+  if (next_cells_found_) {
+    next_cells_found_ = false;
+    return;
+  }
+
+  for_all_cells(cells_, [this](cell_type & c) {
+    c.remove_particles_if([this,&c](particle_type & p) {
+      return migrate_particle(c, p);
+    });
+  });
+  add_migrants(layout_tag<grid_layout::migrating>{});
+}
+
+template <typename T, typename P>
+void grid<T,P>::add_migrants(layout_tag<grid_layout::migrating>)
+{
+  for (auto && m : migrants_) {
+    for (auto && q : m) {
+      if (q.target->add_particle(q.position, q.hv, q.velocity)) {
+        allocations_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    m.clear();
+  }
+}
+
+// Moves p to the migration list of the thread if it left cell c
+template <typename T, typename P>
+bool grid<T,P>::migrate_particle(cell_type & c, particle_type & p)
+{
+  auto i = p.grid_position(domain_);
+  c.check(i);
+  cell_type & target = cells_(i);
+  if (&target == &c) {
+    p.clear_forces();
+    return false;
+  }
+  migrants_.local().push_back(migrant{&target, p.position(), p.hv(), p.velocity()});
+  return true;
+}
+
+template <typename T, typename P>
+void grid<T,P>::rebuild_grid(layout_tag<grid_layout::contiguous>)
+{
+  sort_particles();
+}
+
+// Applies f to every cell of a cube in traversal order
+template <typename T, typename P>
+template <typename F>
+void grid<T,P>::for_all_cells(cube_type & cube, F f)
+{
+  if (P::order == cell_order::morton) {
+    execution::for_range(0, cell_sequence_.size(), [this,&cube,&f](size_t k) {
+      // Contiguous layout skips empty cells without accessing them
+      if (P::layout != grid_layout::contiguous || cell_offsets_[k] != cell_offsets_[k+1]) {
+        f(cube(cell_sequence_[k]));
+      }
+    });
+  }
+  else {
+    yapl::apply(cube.all(), f);
+  }
+}
+
+// Sorting key of a cell (its position in traversal order)
+template <typename T, typename P>
+size_t grid<T,P>::cell_key(const yapl::cube_index & i) const
+{
+  const size_t n = domain_.cell_number(i);
+  return (P::order == cell_order::morton) ? cell_ranks_[n] : n;
+}
+
+template <typename T, typename P>
+yapl::cube_index grid<T,P>::key_cell(size_t k) const
+{
+  return (P::order == cell_order::morton) ? cell_sequence_[k] : domain_.cell_index(k);
+}
+
+// Counting sort of particles by cell key.
+// Particle order within a cell is preserved by sequential executions.
+template <typename T, typename P>
+void grid<T,P>::sort_particles()
+{
+  const size_t np = particles_.size();
+  const size_t nc = domain_.num_cells_;
+
+  // Count particles per cell
+  if (!next_cells_found_) {
+    execution::for_range(0, nc, [this](size_t k) {
+      cell_counts_[k].store(0, std::memory_order_relaxed);
+    });
+
+    execution::for_range(0, np, [this](size_t i) {
+      count_particle(i, cells_(key_cell(particle_cells_[i])));
+    });
+  }
+  next_cells_found_ = false;
+
+  // Exclusive prefix sum of counts gives the first particle of every cell
+  cell_offsets_[0] = 0;
+  for (size_t k=0; k<nc; ++k) {
+    cell_offsets_[k+1] = cell_offsets_[k] + cell_counts_[k].load(std::memory_order_relaxed);
+    cell_counts_[k].store(cell_offsets_[k], std::memory_order_relaxed);
+  }
+
+  // Scatter particles to their position in cell order
+  execution::for_range(0, np, [this](size_t i) {
+    const size_t k = particle_cells2_[i];
+    const size_t j = cell_counts_[k].fetch_add(1, std::memory_order_relaxed);
+    particles2_[j] = particles_[i];
+    particle_cells_[j] = k;
+  });
+  std::swap(particles_, particles2_);
+
+  assign_cell_ranges();
+}
+
+// Records the next cell of particle i, which is in cell c
+template <typename T, typename P>
+void grid<T,P>::count_particle(size_t i, const cell_type & c)
+{
+  auto idx = particles_[i].grid_position(domain_);
+  c.check(idx);
+  const size_t k = cell_key(idx);
+  particle_cells2_[i] = k;
+  cell_counts_[k].fetch_add(1, std::memory_order_relaxed);
+}
+
+template <typename T, typename P>
+void grid<T,P>::assign_cell_ranges()
+{
+  yapl::apply_indexed(cells_.all(), [this](cell_type & c, const yapl::cube_index & i) {
+    const size_t k = cell_key(i);
+    c.assign_particles(particles_, cell_offsets_[k], cell_offsets_[k+1]);
+  });
+}
+
+// Sorts particles within every cell along a Hilbert curve
+template <typename T, typename P>
+void grid<T,P>::reorder_particles()
+{
+  lists_valid_ = false;
+  reorder_particles(layout_tag<storage_layout>{});
+}
+
+template <typename T, typename P>
+void grid<T,P>::reorder_particles(layout_tag<grid_layout::cells>)
+{
+  for_all_cells(cells_, [this](cell_type & c) {
+    c.reorder_particles([this](const particle_type & p) {
+      return particle_key(p);
+    }, reorder_keys_.local(), reorder_scratch_.local());
+  });
+}
+
+template <typename T, typename P>
+void grid<T,P>::reorder_particles(layout_tag<grid_layout::contiguous>)
+{
+  execution::for_range(0, domain_.num_cells_, [this](size_t k) {
+    const size_t first = cell_offsets_[k];
+    const size_t last = cell_offsets_[k+1];
+    auto & keys = reorder_keys_.local();
+    keys.clear();
+    for (size_t i=first; i<last; ++i) {
+      keys.emplace_back(particle_key(particles_[i]), i);
+    }
+    std::sort(keys.begin(), keys.end());
+    for (size_t i=first; i<last; ++i) {
+      particles2_[i] = particles_[keys[i-first].second];
+    }
+  });
+  std::swap(particles_, particles2_);
+
+  assign_cell_ranges();
+}
+
+// Position along a Hilbert curve on a lattice of 2^16 points per dimension
+template <typename T, typename P>
+std::uint64_t grid<T,P>::particle_key(const particle_type & p) const
+{
+  using namespace constants;
+  constexpr unsigned bits = 16;
+  constexpr int max = (1 << bits) - 1;
+  space_vector<int> i { (p.position() - DOMAIN_MIN<T>()) / DOMAIN_RANGE<T>() * T(max) };
+  i.box({0,0,0}, {max,max,max});
+  return hilbert_code(yapl::cube_index{size_t(i.x()), size_t(i.y()), size_t(i.z())}, bits);
+}
+
+
+// Applies f(c, walls) to the non empty cells touching walls in a single
+// parallel loop
+template <typename T, typename P>
+template <typename F>
+void grid<T,P>::for_all_boundary_cells(F f)
+{
+  execution::for_range(0, boundary_cells_.size(), [this,&f](size_t k) {
+    cell_type * c = cell_ptrs_[boundary_cells_[k].first];
+    if (c != nullptr) {
+      f(*c, boundary_cells_[k].second);
+    }
+  });
+}
 
 template <typename T, typename P>
 void grid<T,P>::process_collisions()
 {
-  do_process_collisions_lower<0>();
-  do_process_collisions_upper<0>();
-  do_process_collisions_lower<1>();
-  do_process_collisions_upper<1>();
-  do_process_collisions_lower<2>();
-  do_process_collisions_upper<2>();
+  for_all_boundary_cells([this](cell_type & c, unsigned walls) {
+    c.for_all_particles([this,walls](particle_type & p) {
+      process_collisions(p, walls);
+    });
+  });
+}
+
+// Walls are processed in the order of dimensions, lower before upper
+template <typename T, typename P>
+void grid<T,P>::process_collisions(particle_type & p, unsigned walls)
+{
+  if (walls & 0x01) p.template process_collision_lower<0>();
+  if (walls & 0x02) p.template process_collision_upper<0>();
+  if (walls & 0x04) p.template process_collision_lower<1>();
+  if (walls & 0x08) p.template process_collision_upper<1>();
+  if (walls & 0x10) p.template process_collision_lower<2>();
+  if (walls & 0x20) p.template process_collision_upper<2>();
 }
 
 // Notes on USE_ImpeneratableWall
@@ -138,50 +917,260 @@ template <typename T, typename P>
 void grid<T,P>::reprocess_collisions()
 {
 #ifdef USE_ImpeneratableWall
-  do_reprocess_collisions_lower<0>();
-  do_reprocess_collisions_upper<0>();
-  do_reprocess_collisions_lower<1>();
-  do_reprocess_collisions_upper<1>();
-  do_reprocess_collisions_lower<2>();
-  do_reprocess_collisions_upper<2>();
+  for_all_boundary_cells([this](cell_type & c, unsigned walls) {
+    c.for_all_particles([this,walls](particle_type & p) {
+      reprocess_collisions(p, walls);
+    });
+  });
 #endif
 }
 
+template <typename T, typename P>
+void grid<T,P>::reprocess_collisions(particle_type & p, unsigned walls)
+{
+  if (walls & 0x01) p.template reprocess_collision_lower<0>();
+  if (walls & 0x02) p.template reprocess_collision_upper<0>();
+  if (walls & 0x04) p.template reprocess_collision_lower<1>();
+  if (walls & 0x08) p.template reprocess_collision_upper<1>();
+  if (walls & 0x10) p.template reprocess_collision_lower<2>();
+  if (walls & 0x20) p.template reprocess_collision_upper<2>();
+}
+
 template <typename T, typename P>
 void grid<T,P>::advance_particles()
 {
-  yapl::apply(cells_.all(), [](cell_type & c) {
-    c.for_all_particles([](particle<T> & p) {
+  for_all_cells(cells_, [](cell_type & c) {
+    c.for_all_particles([](particle_type & p) {
       p.advance();
     });
   });
 }
 
+// Cells are visited by number, which does not change results since
+// every particle is processed on its own.
+template <typename T, typename P>
+void grid<T,P>::integrate()
+{
+  begin_integration();
+  execution::for_range(0, domain_.num_cells_, [this](size_t n) {
+    cell_type * c = cell_ptrs_[n];
+    if (c != nullptr) {
+      integrate(*c, n, layout_tag<P::layout>{});
+    }
+  });
+  end_integration();
+}
+
+template <typename T, typename P>
+void grid<T,P>::run_frame_graph()
+{
+  if (P::kernel == kernel_mode::verlet && !lists_valid_) {
+    build_neighbour_lists();
+  }
+  begin_integration();
+  frame_graph_.run();
+  end_integration();
+}
+
+template <typename T, typename P>
+void grid<T,P>::begin_integration()
+{
+  if (P::layout == grid_layout::contiguous) {
+    execution::for_range(0, domain_.num_cells_, [this](size_t k) {
+      cell_counts_[k].store(0, std::memory_order_relaxed);
+    });
+  }
+}
+
+template <typename T, typename P>
+void grid<T,P>::end_integration()
+{
+  // Particles stay in their cells while neighbour lists are valid
+  const bool migrated = P::layout == grid_layout::migrating && P::kernel != kernel_mode::verlet;
+  if (migrated) {
+    add_migrants(layout_tag<P::layout>{});
+  }
+  next_cells_found_ = migrated || P::layout == grid_layout::contiguous;
+}
+
+// Same operations on p as the separate phases, in the same order
+template <typename T, typename P>
+void grid<T,P>::integrate(particle_type & p, unsigned walls)
+{
+  process_collisions(p, walls);
+  p.advance();
+#ifdef USE_ImpeneratableWall
+  reprocess_collisions(p, walls);
+#endif
+}
+
+template <typename T, typename P>
+void grid<T,P>::integrate(cell_type & c, size_t n, layout_tag<grid_layout::cells>)
+{
+  const unsigned walls = domain_.walls(domain_.cell_index(n));
+  c.for_all_particles([this,walls](particle_type & p) {
+    integrate(p, walls);
+  });
+}
+
+template <typename T, typename P>
+void grid<T,P>::integrate(cell_type & c, size_t n, layout_tag<grid_layout::contiguous>)
+{
+  const auto idx = domain_.cell_index(n);
+  const unsigned walls = domain_.walls(idx);
+  const size_t k = cell_key(idx);
+  for (size_t i=cell_offsets_[k]; i<cell_offsets_[k+1]; ++i) {
+    auto && p = particles_[i];
+    integrate(p, walls);
+    count_particle(i, c);
+  }
+}
+
+template <typename T, typename P>
+void grid<T,P>::integrate(cell_type & c, size_t n, layout_tag<grid_layout::migrating>)
+{
+  const unsigned walls = domain_.walls(domain_.cell_index(n));
+  if (P::kernel == kernel_mode::verlet) {
+    c.for_all_particles([this,walls](particle_type & p) {
+      integrate(p, walls);
+    });
+  }
+  else {
+    c.remove_particles_if([this,&c,walls](particle_type & p) {
+      integrate(p, walls);
+      return migrate_particle(c, p);
+    });
+  }
+}
+
 template <typename T, typename P>
 void grid<T,P>::read(simulation_istream & is, size_t np)
 {
-  space_vector<T> position, hv, velocity;
-  for(size_t i = 0; i < np; ++i)
-  {
-    // Read position, hv and velocity
-    position = is.read_space_vector<T>();
-    hv = is.read_space_vector<T>();
-    velocity = is.read_space_vector<T>();
+  read(is, np, layout_tag<storage_layout>{});
+  filter_cell_pairs();
+}
 
+template <typename T, typename P>
+template <typename F>
+void grid<T,P>::for_all_read_particles(const simulation_istream & is, size_t np, F f)
+{
+  // Chunks are small enough for their decoded particles to stay in cache
+  constexpr size_t chunk_size = 1024;
+  constexpr int nf = simulation_istream::PARTICLE_FLOATS;
+  typename execution::template per_thread<std::vector<float>> chunks;
+  execution::for_range(0, (np + chunk_size - 1) / chunk_size, [&](size_t k) {
+    const size_t first = k * chunk_size;
+    const size_t n = std::min(chunk_size, np - first);
+    auto & chunk = chunks.local();
+    chunk.resize(chunk_size * nf);
+    is.decode_particles(chunk.data(), first, n);
+    const float * v = chunk.data();
+    for (size_t i = first; i < first + n; ++i, v += nf) {
+      f(i, space_vector<T>{v[0], v[1], v[2]},
+        space_vector<T>{v[3], v[4], v[5]},
+        space_vector<T>{v[6], v[7], v[8]});
+    }
+  });
+}
+
+// Cells are found and filled in parallel over chunks of particles.
+// Particle order within a cell is preserved by sequential executions.
+template <typename T, typename P>
+void grid<T,P>::read(simulation_istream & is, size_t np, layout_tag<grid_layout::cells>)
+{
+  for_all_read_particles(is, np, [this](size_t,
+      const space_vector<T> & position, const space_vector<T> & hv, const space_vector<T> & velocity) {
     // Add to cell of position in domain
     cells_(domain_.grid_position(position)).add_particle(position, hv, velocity);
-  }
+  });
+  is.skip_particles(np);
+}
+
+// Particles are decoded to their place in file order, and their cells
+// found, in parallel. Sorting bins them with a parallel counting sort.
+template <typename T, typename P>
+void grid<T,P>::read(simulation_istream & is, size_t np, layout_tag<grid_layout::contiguous>)
+{
+  // Both buffers hold every particle. Sorting overwrites the second one.
+  particles_.resize(np);
+  particles2_.resize(np);
+  particle_cells_.resize(np);
+  particle_cells2_.resize(np);
+
+  for_all_read_particles(is, np, [this](size_t i,
+      const space_vector<T> & position, const space_vector<T> & hv, const space_vector<T> & velocity) {
+    particles_[i].reset(position, hv, velocity);
+    particle_cells_[i] = cell_key(particles_[i].grid_position(domain_));
+  });
+  is.skip_particles(np);
+
+  sort_particles();
 }
 
+// Particles are stored in cell order. The offset of every cell in the
+// file is the prefix sum of the particle counts of the cells before it,
+// so blocks of cells are encoded in parallel. The n particles of a block,
+// from particle first of the file on, are stored to store(first, n) and
+// then passed to done(first, n, values). Returns the number of particles.
+template <typename T, typename P>
+template <typename S, typename D>
+size_t grid<T,P>::encode_blocks(S store, D done) const
+{
+  std::vector<const cell_type *> cells;
+  std::vector<size_t> offsets{0};
+  cells.reserve(domain_.num_cells_);
+  offsets.reserve(domain_.num_cells_ + 1);
+  yapl::apply(cells_.all_ordered(), [&cells,&offsets](const cell_type & c) {
+    cells.push_back(&c);
+    offsets.push_back(offsets.back() + c.num_particles());
+  });
+  const size_t np = offsets.back();
+
+  // Blocks hold the cells whose first particle falls in the same range of
+  // block_size particles
+  constexpr size_t block_size = 16384;
+  execution::for_range(0, (np + block_size - 1) / block_size, [&](size_t k) {
+    const size_t first = std::lower_bound(offsets.begin(), offsets.end() - 1, k * block_size) - offsets.begin();
+    const size_t last = std::lower_bound(offsets.begin(), offsets.end() - 1, (k + 1) * block_size) - offsets.begin();
+    const size_t n = offsets[last] - offsets[first];
+    float * const values = store(offsets[first], n);
+    float * v = values;
+    for (size_t c = first; c < last; ++c) {
+      cells[c]->for_all_particles([&v](const particle_type & p) {
+        p.encode(v);
+        v += simulation_ostream::PARTICLE_FLOATS;
+      });
+    }
+    done(offsets[first], n, values);
+  });
+  return np;
+}
+
+// Threads encode blocks to buffers of their own and write them in place
 template <typename T, typename P>
 void grid<T,P>::write(simulation_ostream & os) const
 {
-  yapl::apply(cells_.all_ordered(), [&os](const cell_type & c) {
-    c.for_all_particles([&os](const particle<T> & p) {
-      p.write(os);
+  typename execution::template per_thread<std::vector<float>> blocks;
+  const size_t np = encode_blocks(
+    [&blocks](size_t, size_t n) {
+      auto & block = blocks.local();
+      block.resize(n * simulation_ostream::PARTICLE_FLOATS);
+      return block.data();
+    },
+    [&os](size_t first, size_t n, const float * values) {
+      os.write_particles(values, first, n);
     });
-  });
+  os.skip_particles(np);
+}
 
+template <typename T, typename P>
+void grid<T,P>::encode(float * values) const
+{
+  encode_blocks(
+    [values](size_t first, size_t) {
+      return values + first * simulation_ostream::PARTICLE_FLOATS;
+    },
+    [](size_t, size_t, const float *) {});
 }
 
 // Precondition: All particles have density = 0
@@ -190,28 +1179,157 @@ template <typename T, typename P>
 void grid<T,P>::compute_forces()
 {
   // Increase densities
-  yapl::apply(cells_.all(), 
-    [this](cell_type & c) {
-      c.for_all_near_particles([this](particle<T> & p1, particle<T> & p2) {
+  if (P::kernel == kernel_mode::verlet && !lists_valid_) {
+    build_neighbour_lists();
+  }
+  increase_densities(kernel_tag<P::kernel>{}, all_groups{this});
+
+  // Transform densities
+  if (!fused_transform) {
+    for_all_cells(cells_,
+      [this](cell_type & c) {
+        c.for_all_particles([this](particle_type & p) {
+          p.transform_density(params_.density_coeff_,params_.h6_);
+        });
+      }
+    );
+  }
+
+  // Transfer accelerations
+  transfer_accelerations(kernel_tag<P::kernel>{}, all_groups{this});
+}
+
+template <typename T, typename P>
+template <typename G>
+void grid<T,P>::increase_densities(kernel_tag<kernel_mode::pairwise>, G groups)
+{
+  if (P::scheduling == cell_scheduling::buffered) {
+    buffered_pass(density_buffers_, T{},
+      [this](particle_type & p1, particle_type & p2) {
+        p1.increase_densities(p2, params_.hsq_);
+      },
+      [this](particle_type & pi, const particle_type & np, T & d) {
+        pi.increase_densities(np, d, params_.hsq_);
+      },
+      [](particle_type & p, const T & d) {
+        p.add_density(d);
+      });
+    return;
+  }
+
+  groups(
+    [this](cell_type & c, cell_type ** first, cell_type ** last) {
+      c.template for_all_near_particles<lock_cells>(first, last, [this](particle_type & p1, particle_type & p2) {
         p1.increase_densities(p2, params_.hsq_);
       });
     }
   );
+}
 
-  // Transform densities
-  yapl::apply(cells_.all(),
-    [this](cell_type & c) {
-      c.for_all_particles([this](particle<T> & p) {
-        p.transform_density(params_.density_coeff_,params_.h6_);
+// Every group writes the particles of its own cell directly, and the
+// particles of its neighbours through the buffer of its thread. Buffers are
+// then merged per cell in group order, so that results do not depend on
+// the number of threads or on scheduling.
+template <typename T, typename P>
+template <typename V, typename F, typename G, typename A>
+void grid<T,P>::buffered_pass(buffer_set<V> & buffers, const V & zero, F f, G g, A add)
+{
+  for (auto & b : buffers) {
+    b.values.clear();
+    b.segments.clear();
+  }
+
+  execution::for_range(0, active_groups_.size() - 1, [&](size_t group) {
+    auto & b = buffers.local();
+    cell_type ** first = active_cells_.data() + active_groups_[group];
+    cell_type ** last = active_cells_.data() + active_groups_[group+1];
+
+    size_t offsets[max_neighbours];
+    size_t k = 0;
+    for (cell_type ** it=first+1; it!=last; ++it, ++k) {
+      offsets[k] = b.values.size();
+      b.segments.push_back(contribution_segment{*it, group, offsets[k]});
+      b.values.resize(b.values.size() + (*it)->num_particles(), zero);
+    }
+
+    (*first)->for_all_near_indexed(first+1, last, f,
+      [&b,&offsets,&g](particle_type & pi, const particle_type & np, size_t k, size_t j) {
+        g(pi, np, b.values[offsets[k] + j]);
+      });
+  });
+
+  // Contributions to every cell sorted by group
+  using source = std::pair<const contribution_segment *, const V *>;
+  std::vector<source> sources;
+  for (auto & b : buffers) {
+    for (auto & s : b.segments) {
+      sources.emplace_back(&s, b.values.data() + s.first);
+    }
+  }
+  std::sort(sources.begin(), sources.end(), [](const source & a, const source & b) {
+    if (a.first->target != b.first->target) {
+      return std::less<cell_type *>{}(a.first->target, b.first->target);
+    }
+    return a.first->group < b.first->group;
+  });
+
+  std::vector<size_t> targets;
+  for (size_t s=0; s<sources.size(); ++s) {
+    if (s == 0 || sources[s].first->target != sources[s-1].first->target) {
+      targets.push_back(s);
+    }
+  }
+  targets.push_back(sources.size());
+
+  execution::for_range(0, targets.size() - 1, [&](size_t t) {
+    for (size_t s=targets[t]; s<targets[t+1]; ++s) {
+      const V * values = sources[s].second;
+      size_t j = 0;
+      sources[s].first->target->for_all_particles([&](particle_type & p) {
+        add(p, values[j++]);
+      });
+    }
+  });
+}
+
+template <typename T, typename P>
+template <typename G>
+void grid<T,P>::increase_densities(kernel_tag<kernel_mode::simd>, G groups)
+{
+  using block_type = soa_block<T>;
+  groups(
+    [this](cell_type & c, cell_type ** first, cell_type ** last) {
+      c.template for_all_near_blocks<lock_cells>(first, last, [this](const block_type & a, const block_type & b) {
+        density_kernel_(a, b, params_.hsq_);
       });
     }
   );
+}
 
-  // Transfer accelerations
-  yapl::apply(cells_.all(),
-    [this](cell_type & c) {
-      c.for_all_near_particles([this](particle<T> & p1, particle<T> & p2) {
-        p1.transfer_acceleration(p2, params_.h_, params_.hsq_,
+template <typename T, typename P>
+template <typename G>
+void grid<T,P>::transfer_accelerations(kernel_tag<kernel_mode::pairwise>, G groups)
+{
+  if (P::scheduling == cell_scheduling::buffered) {
+    buffered_pass(acceleration_buffers_, space_vector<T>{0, 0, 0},
+      [this](particle_type & p1, particle_type & p2) {
+        p1.template transfer_acceleration<math>(p2, params_.h_, params_.hsq_,
+          params_.pressure_coeff_, params_.viscosity_coeff_);
+      },
+      [this](particle_type & pi, const particle_type & np, space_vector<T> & a) {
+        pi.template transfer_acceleration<math>(np, a, params_.h_, params_.hsq_,
+          params_.pressure_coeff_, params_.viscosity_coeff_);
+      },
+      [](particle_type & p, const space_vector<T> & a) {
+        p.add_acceleration(a);
+      });
+    return;
+  }
+
+  groups(
+    [this](cell_type & c, cell_type ** first, cell_type ** last) {
+      c.template for_all_near_particles<lock_cells>(first, last, [this](particle_type & p1, particle_type & p2) {
+        p1.template transfer_acceleration<math>(p2, params_.h_, params_.hsq_,
           params_.pressure_coeff_, params_.viscosity_coeff_);
       });
     }
@@ -219,75 +1337,127 @@ void grid<T,P>::compute_forces()
 }
 
 template <typename T, typename P>
-void grid<T,P>::get_statistics(float & m, float & v, size_t & nempty) const
+template <typename G>
+void grid<T,P>::transfer_accelerations(kernel_tag<kernel_mode::simd>, G groups)
 {
-  std::vector<size_t> count;
-  nempty = 0;
-  apply(cells_.all_ordered(), [&count, &nempty](cell_type & c) {
-    size_t num = c.num_particles();
-    count.push_back(num);
-    if (num>0) nempty++;
-  });
-  size_t n = std::accumulate(count.begin(), count.end(), 0);
-  m = static_cast<float>(n) / domain_.num_cells_;
-
-  v = 0.0;
-  for (auto c : count) {
-    v+= (c-m) * (c-m);
-  }
-  v = std::sqrt(v);
+  using block_type = soa_block<T>;
+  groups(
+    [this](cell_type & c, cell_type ** first, cell_type ** last) {
+      c.template for_all_near_blocks<lock_cells>(first, last, [this](const block_type & a, const block_type & b) {
+        force_kernel_(a, b, params_);
+      });
+    }
+  );
 }
 
 template <typename T, typename P>
-template <int I>
-void grid<T,P>::do_process_collisions_lower()
+template <typename G>
+void grid<T,P>::increase_densities(kernel_tag<kernel_mode::verlet>, G groups)
 {
-  yapl::apply(cells_.template plane<I>(0), 
-    [](cell_type & c) { 
-      c.for_all_particles([](particle<T> & p) {
-        p.template process_collision_lower<I>();
+  groups(
+    [this](cell_type & c, cell_type ** first, cell_type ** last) {
+      c.template for_all_listed_pairs<lock_cells>(first, last, [this](particle_type & p1, particle_type & p2) {
+        p1.increase_densities(p2, params_.hsq_);
       });
-    });
+    }
+  );
 }
 
 template <typename T, typename P>
-template <int I>
-void grid<T,P>::do_process_collisions_upper()
+template <typename G>
+void grid<T,P>::transfer_accelerations(kernel_tag<kernel_mode::verlet>, G groups)
 {
-  auto upper = domain_.template upper_index<I>();
-  yapl::apply(cells_.template plane<I>(upper), 
-    [](cell_type & c) { 
-      c.for_all_particles([](particle<T> & p) {
-        p.template process_collision_upper<I>();
+  groups(
+    [this](cell_type & c, cell_type ** first, cell_type ** last) {
+      c.template for_all_listed_pairs<lock_cells>(first, last, [this](particle_type & p1, particle_type & p2) {
+        p1.template transfer_acceleration<math>(p2, params_.h_, params_.hsq_,
+          params_.pressure_coeff_, params_.viscosity_coeff_);
       });
-    });
+    }
+  );
 }
 
 template <typename T, typename P>
-template <int I>
-void grid<T,P>::do_reprocess_collisions_lower()
+template <typename G>
+void grid<T,P>::increase_densities(kernel_tag<kernel_mode::gather>, G groups)
 {
-  yapl::apply(cells_.template plane<I>(0), 
-    [](cell_type & c) { 
-      c.for_all_particles([](particle<T> & p) {
-        p.template reprocess_collision_lower<I>();
+  groups(
+    [this](cell_type & c, cell_type ** first, cell_type ** last) {
+      c.gather_near_particles(first, last, [this](particle_type & pi, const particle_type & pj) {
+        pi.gather_density(pj, params_.hsq_);
       });
-    });
+      // Densities of the cell are complete
+      if (fused_transform) {
+        c.for_all_particles([this](particle_type & p) {
+          p.transform_density(params_.density_coeff_, params_.h6_);
+        });
+      }
+    }
+  );
 }
 
 template <typename T, typename P>
-template <int I>
-void grid<T,P>::do_reprocess_collisions_upper()
+template <typename G>
+void grid<T,P>::transfer_accelerations(kernel_tag<kernel_mode::gather>, G groups)
 {
-  auto upper = domain_.template upper_index<I>();
-  yapl::apply(cells_.template plane<I>(upper), 
-    [](cell_type & c) { 
-      c.for_all_particles([](particle<T> & p) {
-        p.template reprocess_collision_upper<I>();
+  groups(
+    [this](cell_type & c, cell_type ** first, cell_type ** last) {
+      c.gather_near_particles(first, last, [this](particle_type & pi, const particle_type & pj) {
+        pi.template gather_acceleration<math>(pj, params_.h_, params_.hsq_,
+          params_.pressure_coeff_, params_.viscosity_coeff_);
       });
-    });
+    }
+  );
+}
+
+template <typename T, typename P>
+void grid<T,P>::build_neighbour_lists()
+{
+  // Positions of every cell are saved, including empty ones
+  yapl::apply(cells_.all(), [](cell_type & c) {
+    c.save_positions();
+  });
+  for_all_cell_groups([this](cell_type & c, cell_type ** first, cell_type ** last) {
+    c.build_near_pairs(first, last, list_radius_sq_);
+  });
+  lists_valid_ = true;
+  ++list_builds_;
+}
+
+// Checks whether any particle moved more than half the skin since
+// neighbour lists were built
+template <typename T, typename P>
+bool grid<T,P>::moved_beyond_skin()
+{
+  counter_type moved;
+  moved.store(0, std::memory_order_relaxed);
+  for_all_cells(cells_, [this,&moved](cell_type & c) {
+    if (c.max_square_displacement() > max_displacement_sq_) {
+      moved.store(1, std::memory_order_relaxed);
+    }
+  });
+  return moved.load(std::memory_order_relaxed) != 0;
 }
 
+template <typename T, typename P>
+void grid<T,P>::get_statistics(float & m, float & v, size_t & nempty) const
+{
+  std::vector<size_t> count;
+  nempty = 0;
+  apply(cells_.all_ordered(), [&count, &nempty](cell_type & c) {
+    size_t num = c.num_particles();
+    count.push_back(num);
+    if (num>0) nempty++;
+  });
+  size_t n = std::accumulate(count.begin(), count.end(), 0);
+  m = static_cast<float>(n) / domain_.num_cells_;
+
+  v = 0.0;
+  for (auto c : count) {
+    v+= (c-m) * (c-m);
+  }
+  v = std::sqrt(v);
+}
 
 }
 
@@ -0,0 +1,118 @@
+#ifndef FLUID_HALF_FLOAT_H
+#define FLUID_HALF_FLOAT_H
+
+#include <cstdint>
+#include <cstring>
+
+namespace fluid {
+
+inline std::uint32_t float_bits(float f)
+{
+  std::uint32_t u;
+  std::memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+inline float bits_float(std::uint32_t u)
+{
+  float f;
+  std::memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+// IEEE 754 half precision number for storage only. Stores convert from
+// float rounding to nearest even, loads widen to float for arithmetic.
+class binary16 {
+public:
+  binary16() = default;
+  binary16(float f) : bits_{encode(f)} {}
+
+  operator float() const { return decode(bits_); }
+
+private:
+  static std::uint16_t encode(float f);
+  static float decode(std::uint16_t h);
+
+private:
+  std::uint16_t bits_;
+};
+
+// Conversions after F. Giesen, half_float.cpp (2012)
+inline std::uint16_t binary16::encode(float f)
+{
+  const std::uint32_t f32_infinity = 255u << 23;
+  const std::uint32_t f16_overflow = (127u + 16u) << 23;
+  const std::uint32_t denormal_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+
+  std::uint32_t u = float_bits(f);
+  const std::uint32_t sign = u & 0x80000000u;
+  u ^= sign;
+
+  std::uint16_t h;
+  if (u >= f16_overflow) {
+    // Infinity, or quiet NaN
+    h = (u > f32_infinity) ? 0x7e00 : 0x7c00;
+  }
+  else if (u < (113u << 23)) {
+    // Subnormal or zero: the addition rounds the mantissa into place
+    const float r = bits_float(u) + bits_float(denormal_magic);
+    h = static_cast<std::uint16_t>(float_bits(r) - denormal_magic);
+  }
+  else {
+    // Rebias the exponent and round the mantissa to nearest even
+    const std::uint32_t odd = (u >> 13) & 1u;
+    u += 0xc8000fffu + odd;
+    h = static_cast<std::uint16_t>(u >> 13);
+  }
+  return h | static_cast<std::uint16_t>(sign >> 16);
+}
+
+inline float binary16::decode(std::uint16_t h)
+{
+  const std::uint32_t exponent_mask = 0x7c00u << 13;
+  std::uint32_t u = (h & 0x7fffu) << 13;
+  const std::uint32_t exponent = u & exponent_mask;
+  u += (127u - 15u) << 23;
+
+  if (exponent == exponent_mask) {
+    // Infinity or NaN
+    u += (128u - 16u) << 23;
+  }
+  else if (exponent == 0) {
+    // Subnormal or zero: renormalize
+    u += 1u << 23;
+    u = float_bits(bits_float(u) - bits_float(113u << 23));
+  }
+  return bits_float(u | (static_cast<std::uint32_t>(h & 0x8000u) << 16));
+}
+
+// Brain floating point number (upper half of a float) for storage only.
+// Keeps the range of float with 8 bits of mantissa.
+class bfloat16 {
+public:
+  bfloat16() = default;
+  bfloat16(float f) : bits_{encode(f)} {}
+
+  operator float() const { return bits_float(static_cast<std::uint32_t>(bits_) << 16); }
+
+private:
+  static std::uint16_t encode(float f);
+
+private:
+  std::uint16_t bits_;
+};
+
+inline std::uint16_t bfloat16::encode(float f)
+{
+  std::uint32_t u = float_bits(f);
+  if ((u & 0x7fffffffu) > 0x7f800000u) {
+    // Quiet NaN
+    return static_cast<std::uint16_t>((u >> 16) | 0x40u);
+  }
+  u += 0x7fffu + ((u >> 16) & 1u);
+  return static_cast<std::uint16_t>(u >> 16);
+}
+
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef FLUID_INSTRUCTION_SET_H
+#define FLUID_INSTRUCTION_SET_H
+
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FLUID_X86_SIMD
+#endif
+
+namespace fluid {
+
+enum class instruction_set {
+  scalar,
+  sse42,
+  avx2,
+  avx512
+};
+
+inline const char * instruction_set_name(instruction_set isa)
+{
+  switch (isa) {
+    case instruction_set::sse42: return "sse4.2";
+    case instruction_set::avx2: return "avx2";
+    case instruction_set::avx512: return "avx512";
+    default: return "scalar";
+  }
+}
+
+// Widest instruction set supported by the running CPU.
+inline instruction_set cpu_instruction_set()
+{
+#ifdef FLUID_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return instruction_set::avx512;
+  if (__builtin_cpu_supports("avx2")) return instruction_set::avx2;
+  if (__builtin_cpu_supports("sse4.2")) return instruction_set::sse42;
+#endif
+  return instruction_set::scalar;
+}
+
+// Instruction set used by batched kernels. The FLUID_ISA environment
+// variable (scalar, sse4.2, avx2 or avx512) may lower the CPU choice.
+inline instruction_set select_instruction_set()
+{
+  const instruction_set cpu = cpu_instruction_set();
+  const char * name = std::getenv("FLUID_ISA");
+  if (name == nullptr) return cpu;
+
+  for (instruction_set isa : { instruction_set::scalar, instruction_set::sse42,
+                               instruction_set::avx2, instruction_set::avx512 }) {
+    if (std::strcmp(name, instruction_set_name(isa)) == 0) {
+      return (isa < cpu) ? isa : cpu;
+    }
+  }
+  return cpu;
+}
+
+}
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef FLUID_MATH_POLICY_H
+#define FLUID_MATH_POLICY_H
+
+#include "instruction_set.h"
+#include <cmath>
+
+#ifdef FLUID_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace fluid {
+
+// Square roots and divisions of particle force kernels. A math policy
+// is chosen at compile time, so that kernels have no branches on it.
+
+// IEEE square root and division
+struct exact_math {
+  template <typename T>
+  static T sqrt(T x) { return std::sqrt(x); }
+
+  template <typename T>
+  static T divide(T a, T b) { return a / b; }
+
+  template <typename T>
+  static T reciprocal(T x) { return T(1) / x; }
+};
+
+// Estimates of 1/sqrt(x) and 1/x with 12 bits of precision, exact where
+// the CPU has no estimate instruction.
+inline float rsqrt_estimate(float x)
+{
+#ifdef FLUID_X86_SIMD
+  return _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+#else
+  return 1.0f / std::sqrt(x);
+#endif
+}
+
+inline float reciprocal_estimate(float x)
+{
+#ifdef FLUID_X86_SIMD
+  return _mm_cvtss_f32(_mm_rcp_ss(_mm_set_ss(x)));
+#else
+  return 1.0f / x;
+#endif
+}
+
+// Square roots as x * (1/sqrt(x)), with the estimate refined by one
+// Newton-Raphson step: r = r * (1.5 - 0.5 * x * r * r). One step only
+// reaches single precision, so doubles are exact.
+struct rsqrt_math {
+  static float sqrt(float x) {
+    const float r = rsqrt_estimate(x);
+    return x * r * (1.5f - 0.5f * x * r * r);
+  }
+
+  static double sqrt(double x) { return std::sqrt(x); }
+
+  template <typename T>
+  static T divide(T a, T b) { return a / b; }
+
+  template <typename T>
+  static T reciprocal(T x) { return T(1) / x; }
+};
+
+// Divisions as products by the estimate of the reciprocal, refined by one
+// Newton-Raphson step: r = r * (2 - x * r). Doubles are exact, as above.
+struct reciprocal_math {
+  template <typename T>
+  static T sqrt(T x) { return std::sqrt(x); }
+
+  static float divide(float a, float b) { return a * reciprocal(b); }
+
+  static double divide(double a, double b) { return a / b; }
+
+  static float reciprocal(float x) {
+    const float r = reciprocal_estimate(x);
+    return r * (2.0f - x * r);
+  }
+
+  static double reciprocal(double x) { return 1.0 / x; }
+};
+
+}
+
+#endif
@@ -7,20 +7,106 @@
 
 namespace fluid {
 
+// Particle fields stored by value, with half velocities and velocities
+// stored in precision C.
+// Copying a particle keeps its state but resets acceleration and density.
+template <typename T, typename C = T>
+class particle_fields {
+public:
+  // A default particle is at rest in the origin
+  particle_fields() : particle_fields{{0, 0, 0}, {0, 0, 0}, {0, 0, 0}} {}
+  particle_fields(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v);
+
+  particle_fields(const particle_fields & p);
+  particle_fields & operator=(const particle_fields & p);
+
+  particle_fields(particle_fields && p) = delete;
+  particle_fields & operator=(particle_fields && p) = delete;
+
+protected:
+  space_vector<T> position_;
+  space_vector<C> hv_;
+  space_vector<C> velocity_;
+  space_vector<T> acceleration_;
+  T density_;
+};
+
+template <typename T, typename C>
+particle_fields<T,C>::particle_fields(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v)
+:
+  position_{p},
+  hv_{hv},
+  velocity_{v},
+  acceleration_{constants::EXTERNAL_ACCELERATION<T>()},
+  density_{}
+{
+}
+
+template <typename T, typename C>
+particle_fields<T,C>::particle_fields(const particle_fields & p)
+:
+particle_fields{p.position_, p.hv_, p.velocity_}
+{
+}
+
+template <typename T, typename C>
+particle_fields<T,C> & particle_fields<T,C>::operator=(const particle_fields & p)
+{
+  position_ = p.position_;
+  hv_ = p.hv_;
+  velocity_ = p.velocity_;
+  acceleration_ = constants::EXTERNAL_ACCELERATION<T>();
+  density_ = T{};
+  return *this;
+}
+
+// Particle fields referring to a particle stored elsewhere (e.g. in a
+// structure of arrays). Copying the reference aliases the same particle,
+// while assigning writes through as particle_fields assignment does.
 template <typename T>
-class particle {
+class particle_field_refs {
 public:
+  particle_field_refs(const space_vector_ref<T> & p, const space_vector_ref<T> & hv, 
+      const space_vector_ref<T> & v, const space_vector_ref<T> & a, T & d)
+  :
+    position_{p},
+    hv_{hv},
+    velocity_{v},
+    acceleration_{a},
+    density_{d}
+  {}
+
+  particle_field_refs(const particle_field_refs & p) = default;
+
+  particle_field_refs & operator=(const particle_field_refs & p) {
+    position_ = space_vector<T>(p.position_);
+    hv_ = space_vector<T>(p.hv_);
+    velocity_ = space_vector<T>(p.velocity_);
+    acceleration_ = constants::EXTERNAL_ACCELERATION<T>();
+    density_ = T{};
+    return *this;
+  }
 
-  using index_type = yapl::cube_index;
+protected:
+  space_vector_ref<T> position_;
+  space_vector_ref<T> hv_;
+  space_vector_ref<T> velocity_;
+  space_vector_ref<T> acceleration_;
+  T & density_;
+};
 
+template <typename T, typename F>
+class basic_particle : public F {
 public:
-  particle(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v);
 
-  particle(const particle & p);
-  particle & operator=(const particle & p) = delete;
+  using index_type = yapl::cube_index;
+
+public:
+  using F::F;
 
-  particle(particle && p) = delete;
-  particle & operator=(particle && p) = delete;
+  space_vector<T> position() const { return position_; }
+  space_vector<T> hv() const { return hv_; }
+  space_vector<T> velocity() const { return velocity_; }
 
   index_type grid_position(const domain<T> & d) const;
 
@@ -41,14 +127,38 @@ public:
 
   void advance();
 
-  void increase_densities(particle<T> & p, T hsq);
+  // Same reset as copying, for particles that stay in place
+  void clear_forces();
+
+  // Same state as a particle constructed from p, hv and v
+  void reset(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v);
+
+  void increase_densities(basic_particle & p, T hsq);
   void transform_density(T dc, T h6);
-  void transfer_acceleration(particle<T> & p, T h, T hsq, T pc, T vc);
 
-  void write(simulation_ostream & os) const;
+  // Force kernels take square roots and divide as math policy M says
+  template <typename M>
+  void transfer_acceleration(basic_particle & p, T h, T hsq, T pc, T vc);
+
+  // Contributions of p to this particle only
+  void gather_density(const basic_particle & p, T hsq);
+  template <typename M>
+  void gather_acceleration(const basic_particle & p, T h, T hsq, T pc, T vc);
+
+  // Contributions of a pair to this particle and to an accumulator pd
+  // or pa of p, which is the density or acceleration of p itself above
+  void increase_densities(const basic_particle & p, T & pd, T hsq);
+  template <typename M, typename A>
+  void transfer_acceleration(const basic_particle & p, A & pa, T h, T hsq, T pc, T vc);
+
+  void add_density(T d) { density_ += d; }
+  void add_acceleration(const space_vector<T> & a) { acceleration_ += a; }
+
+  // Position, hv and velocity as the floats of a particle in files
+  void encode(float * v) const;
 
   template <class OS>
-  friend OS & operator<<(OS & os, const particle & p) {
+  friend OS & operator<<(OS & os, const basic_particle & p) {
     return os << "P : " << p.position_ << std::endl;
   }
 
@@ -68,48 +178,41 @@ private:
 
 
 private:
-  space_vector<T> position_;
-  space_vector<T> hv_;
-  space_vector<T> velocity_;
-  space_vector<T> acceleration_;
-  T density_;
+  using F::position_;
+  using F::hv_;
+  using F::velocity_;
+  using F::acceleration_;
+  using F::density_;
 };
 
 template <typename T>
-particle<T>::particle(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v)
-:
-  position_{p},
-  hv_{hv},
-  velocity_{v},
-  acceleration_{constants::EXTERNAL_ACCELERATION<T>()},
-  density_{}
-{
-}
+using particle = basic_particle<T, particle_fields<T>>;
 
-template <typename T>
-particle<T>::particle(const particle & p)
-:
-particle{p.position_, p.hv_, p.velocity_}
-{
-}
+// Particle with half velocities and velocities, which are read only by
+// integration and viscosity, stored in 16 bits of type C
+template <typename T, typename C>
+using compact_particle = basic_particle<T, particle_fields<T, C>>;
 
 template <typename T>
-yapl::cube_index particle<T>::grid_position(const domain<T> & d) const
+using particle_ref = basic_particle<T, particle_field_refs<T>>;
+
+template <typename T, typename F>
+yapl::cube_index basic_particle<T,F>::grid_position(const domain<T> & d) const
 {
   return d.grid_position(position_);
 }
 
-template <typename T>
+template <typename T, typename F>
 template <unsigned int D>
-T particle<T>::next_position() const
+T basic_particle<T,F>::next_position() const
 {
   using namespace constants;
   return position_.template get<D>() + hv_.template get<D>() * TIME_STEP<T>();
 }
 
-template <typename T>
+template <typename T, typename F>
 template <int I>
-void particle<T>::process_collision_lower()
+void basic_particle<T,F>::process_collision_lower()
 {
   using namespace constants;
   T diff = PARTICLE_SIZE<T>() - distance_to_lower_limit<I>(next_position<I>());
@@ -118,9 +221,9 @@ void particle<T>::process_collision_lower()
   }
 }
 
-template <typename T>
+template <typename T, typename F>
 template <int I>
-void particle<T>::process_collision_upper()
+void basic_particle<T,F>::process_collision_upper()
 {
   using namespace constants;
   T diff = PARTICLE_SIZE<T>() - distance_to_upper_limit<I>(next_position<I>());
@@ -129,9 +232,9 @@ void particle<T>::process_collision_upper()
   }
 }
 
-template <typename T>
+template <typename T, typename F>
 template <int D>
-void particle<T>::reprocess_collision_lower()
+void basic_particle<T,F>::reprocess_collision_lower()
 {
   using namespace constants;
   T diff = distance_to_lower_limit<D>(position_.template get<D>());
@@ -140,9 +243,9 @@ void particle<T>::reprocess_collision_lower()
   }
 }
 
-template <typename T>
+template <typename T, typename F>
 template <int D>
-void particle<T>::reprocess_collision_upper()
+void basic_particle<T,F>::reprocess_collision_upper()
 {
   using namespace constants;
   T diff = distance_to_upper_limit<D>(position_.template get<D>());
@@ -151,92 +254,154 @@ void particle<T>::reprocess_collision_upper()
   }
 }
 
-template <typename T>
-void particle<T>::advance()
+template <typename T, typename F>
+void basic_particle<T,F>::advance()
 {
   using namespace constants;
-  space_vector<T> v_half = hv_ + acceleration_ * TIME_STEP<T>();
+  const space_vector<T> old_hv = hv_;
+  space_vector<T> v_half = old_hv + space_vector<T>(acceleration_) * TIME_STEP<T>();
   position_ += v_half * TIME_STEP<T>();
-  velocity_ = hv_ + v_half;
-  velocity_ *= 0.5;
+  velocity_ = (old_hv + v_half) * T(0.5);
   hv_ = v_half;
 }
 
-template <typename T>
-void particle<T>::increase_densities(particle<T> & p, T hsq)
+template <typename T, typename F>
+void basic_particle<T,F>::clear_forces()
+{
+  acceleration_ = constants::EXTERNAL_ACCELERATION<T>();
+  density_ = T{};
+}
+
+template <typename T, typename F>
+void basic_particle<T,F>::reset(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v)
+{
+  position_ = p;
+  hv_ = hv;
+  velocity_ = v;
+  clear_forces();
+}
+
+template <typename T, typename F>
+void basic_particle<T,F>::increase_densities(basic_particle & p, T hsq)
+{
+  increase_densities(p, p.density_, hsq);
+}
+
+template <typename T, typename F>
+void basic_particle<T,F>::increase_densities(const basic_particle & p, T & pd, T hsq)
 {
   T distsq = position_.square_distance(p.position_);
   if (distsq < hsq) {
     T t = hsq - distsq;
     T tc = t * t * t;
     density_ += tc;
-    p.density_ += tc;
+    pd += tc;
   }
 }
 
-template <typename T>
-void particle<T>::transfer_acceleration(particle<T> & p, T h, T hsq, T pc, T vc)
+template <typename T, typename F>
+template <typename M>
+void basic_particle<T,F>::transfer_acceleration(basic_particle & p, T h, T hsq, T pc, T vc)
+{
+  transfer_acceleration<M>(p, p.acceleration_, h, hsq, pc, vc);
+}
+
+template <typename T, typename F>
+template <typename M, typename A>
+void basic_particle<T,F>::transfer_acceleration(const basic_particle & p, A & pa, T h, T hsq, T pc, T vc)
 {
   using namespace constants;
   auto disp = position_ - p.position_;
   T distsq = disp.norm();
   if (distsq < hsq) {
-    T dist = std::sqrt(std::max(distsq, T(1e-12)));
+    T dist = M::sqrt(std::max(distsq, T(1e-12)));
     T hmr = h - dist;
 
-    auto acc = disp * pc * (hmr * hmr / dist);
+    auto acc = disp * pc * M::divide(hmr * hmr, dist);
     acc *= (density_ + p.density_ - DOUBLE_REST_DENSITY<T>());
-    acc += (p.velocity_ - velocity_) * vc * hmr;
-    acc /= density_ * p.density_;
+    acc += (p.velocity() - velocity()) * vc * hmr;
+    acc *= M::reciprocal(density_ * p.density_);
 
     acceleration_ += acc;
-    p.acceleration_ -= acc;
+    pa -= acc;
   }
 }
 
-template <typename T>
-void particle<T>::transform_density(T dc, T h6)
+template <typename T, typename F>
+void basic_particle<T,F>::gather_density(const basic_particle & p, T hsq)
+{
+  T distsq = (position_ - p.position_).norm();
+  if (distsq < hsq) {
+    T t = hsq - distsq;
+    density_ += t * t * t;
+  }
+}
+
+template <typename T, typename F>
+template <typename M>
+void basic_particle<T,F>::gather_acceleration(const basic_particle & p, T h, T hsq, T pc, T vc)
+{
+  using namespace constants;
+  auto disp = position_ - p.position_;
+  T distsq = disp.norm();
+  if (distsq < hsq) {
+    T dist = M::sqrt(std::max(distsq, T(1e-12)));
+    T hmr = h - dist;
+
+    auto acc = disp * pc * M::divide(hmr * hmr, dist);
+    acc *= (density_ + p.density_ - DOUBLE_REST_DENSITY<T>());
+    acc += (p.velocity() - velocity()) * vc * hmr;
+    acc *= M::reciprocal(density_ * p.density_);
+
+    acceleration_ += acc;
+  }
+}
+
+template <typename T, typename F>
+void basic_particle<T,F>::transform_density(T dc, T h6)
 {
   density_ += h6;
   density_ *= dc;
 }
 
-template <typename T>
-void particle<T>::write(simulation_ostream & os) const
+template <typename T, typename F>
+void basic_particle<T,F>::encode(float * v) const
 {
-  os.write_space_vector(position_);
-  os.write_space_vector(hv_);
-  os.write_space_vector(velocity_);
+  const space_vector<T> hv = hv_;
+  const space_vector<T> velocity = velocity_;
+  v[0] = position_.x(); v[1] = position_.y(); v[2] = position_.z();
+  v[3] = hv.x(); v[4] = hv.y(); v[5] = hv.z();
+  v[6] = velocity.x(); v[7] = velocity.y(); v[8] = velocity.z();
 }
 
-template <typename T>
+template <typename T, typename F>
 template <unsigned int D>
-T particle<T>::distance_to_lower_limit(T pos) const
+T basic_particle<T,F>::distance_to_lower_limit(T pos) const
 {
   using namespace constants;
   return pos - DOMAIN_MIN<T>().template get<D>();
 }
 
-template <typename T>
+template <typename T, typename F>
 template <unsigned int D>
-T particle<T>::distance_to_upper_limit(T pos) const
+T basic_particle<T,F>::distance_to_upper_limit(T pos) const
 {
   using namespace constants;
   return DOMAIN_MAX<T>().template get<D>() - pos;
 }
 
-template <typename T>
+template <typename T, typename F>
 template <unsigned int D>
-void particle<T>::process_collision(T diff) 
+void basic_particle<T,F>::process_collision(T diff) 
 {
   position_.template get<D>() = diff;
   velocity_.template get<D>() = -velocity_.template get<D>();
   hv_.template get<D>() = -hv_.template get<D>();
 }
 
-template <typename T>
+template <typename T, typename F>
 template <unsigned int D>
-void particle<T>::increase_acceleration(T diff)
+void basic_particle<T,F>::increase_acceleration(T diff)
 {
   using namespace constants;
   acceleration_.template get<D>() += STIFFNESS_COLLISIONS<T>() * diff - DAMPING<T>() * velocity_.template get<D>();
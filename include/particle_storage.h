@@ -0,0 +1,216 @@
+#ifndef FLUID_PARTICLE_STORAGE_H
+#define FLUID_PARTICLE_STORAGE_H
+
+#include "particle.h"
+#include "half_float.h"
+#include <vector>
+#include <utility>
+
+namespace fluid {
+
+// Array of structures: every particle is stored as a whole.
+template <typename T>
+using aos_storage = std::vector<particle<T>>;
+
+// Arrays of structures of particles with cold fields in half precision
+// or in bfloat16.
+template <typename T>
+using fp16_storage = std::vector<compact_particle<T, binary16>>;
+
+template <typename T>
+using bf16_storage = std::vector<compact_particle<T, bfloat16>>;
+
+// Array of components of space vectors.
+template <typename T>
+class soa_vector {
+public:
+  size_t size() const { return x_.size(); }
+  size_t capacity() const { return x_.capacity(); }
+
+  space_vector_ref<T> operator[](size_t i) { return {x_[i], y_[i], z_[i]}; }
+
+  void push_back(const space_vector<T> & v) {
+    x_.push_back(v.x());
+    y_.push_back(v.y());
+    z_.push_back(v.z());
+  }
+
+  void pop_back() { x_.pop_back(); y_.pop_back(); z_.pop_back(); }
+  void resize(size_t n, const space_vector<T> & v) { x_.resize(n, v.x()); y_.resize(n, v.y()); z_.resize(n, v.z()); }
+  void clear() { x_.clear(); y_.clear(); z_.clear(); }
+  void shrink_to_fit() { x_.shrink_to_fit(); y_.shrink_to_fit(); z_.shrink_to_fit(); }
+  void reserve(size_t n) { x_.reserve(n); y_.reserve(n); z_.reserve(n); }
+
+  T * x() { return x_.data(); }
+  T * y() { return y_.data(); }
+  T * z() { return z_.data(); }
+
+private:
+  std::vector<T> x_;
+  std::vector<T> y_;
+  std::vector<T> z_;
+};
+
+// Raw pointers to the fields of a range of particles stored as a
+// structure of arrays. Used by batched (SIMD) kernels.
+template <typename T>
+struct soa_block {
+  T * px; T * py; T * pz;
+  T * vx; T * vy; T * vz;
+  T * ax; T * ay; T * az;
+  T * density;
+  size_t size;
+
+  // Block of n particles starting at first
+  soa_block sub(size_t first, size_t n) const {
+    return { px + first, py + first, pz + first,
+             vx + first, vy + first, vz + first,
+             ax + first, ay + first, az + first,
+             density + first, n };
+  }
+};
+
+// Structure of arrays: every particle field is stored in its own array.
+// Particles are accessed through particle_ref proxies.
+template <typename T>
+class soa_storage {
+public:
+  using value_type = particle_ref<T>;
+
+  size_t size() const { return density_.size(); }
+  size_t capacity() const { return density_.capacity(); }
+
+  value_type operator[](size_t i) {
+    return {position_[i], hv_[i], velocity_[i], acceleration_[i], density_[i]};
+  }
+
+  // Constness is preserved by returning a const proxy
+  const value_type operator[](size_t i) const {
+    return const_cast<soa_storage &>(*this)[i];
+  }
+
+  void push_back(const value_type & p) { emplace_back(p.position(), p.hv(), p.velocity()); }
+  void emplace_back(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v);
+  void pop_back();
+
+  void clear();
+  void shrink_to_fit();
+  void reserve(size_t n);
+  void resize(size_t n);
+
+  soa_vector<T> & positions() { return position_; }
+  soa_vector<T> & hvs() { return hv_; }
+  soa_vector<T> & velocities() { return velocity_; }
+  soa_vector<T> & accelerations() { return acceleration_; }
+  T * densities() { return density_.data(); }
+
+  soa_block<T> block() {
+    return { position_.x(), position_.y(), position_.z(),
+             velocity_.x(), velocity_.y(), velocity_.z(),
+             acceleration_.x(), acceleration_.y(), acceleration_.z(),
+             density_.data(), size() };
+  }
+
+private:
+  soa_vector<T> position_;
+  soa_vector<T> hv_;
+  soa_vector<T> velocity_;
+  soa_vector<T> acceleration_;
+  std::vector<T> density_;
+};
+
+template <typename T>
+void soa_storage<T>::emplace_back(const space_vector<T> & p, const space_vector<T> & hv, const space_vector<T> & v)
+{
+  position_.push_back(p);
+  hv_.push_back(hv);
+  velocity_.push_back(v);
+  acceleration_.push_back(constants::EXTERNAL_ACCELERATION<T>());
+  density_.push_back(T{});
+}
+
+template <typename T>
+void soa_storage<T>::pop_back()
+{
+  position_.pop_back();
+  hv_.pop_back();
+  velocity_.pop_back();
+  acceleration_.pop_back();
+  density_.pop_back();
+}
+
+template <typename T>
+void soa_storage<T>::clear()
+{
+  position_.clear();
+  hv_.clear();
+  velocity_.clear();
+  acceleration_.clear();
+  density_.clear();
+}
+
+template <typename T>
+void soa_storage<T>::shrink_to_fit()
+{
+  position_.shrink_to_fit();
+  hv_.shrink_to_fit();
+  velocity_.shrink_to_fit();
+  acceleration_.shrink_to_fit();
+  density_.shrink_to_fit();
+}
+
+template <typename T>
+void soa_storage<T>::reserve(size_t n)
+{
+  position_.reserve(n);
+  hv_.reserve(n);
+  velocity_.reserve(n);
+  acceleration_.reserve(n);
+  density_.reserve(n);
+}
+
+// New particles are at rest in the origin, as default particles are
+template <typename T>
+void soa_storage<T>::resize(size_t n)
+{
+  position_.resize(n, {0, 0, 0});
+  hv_.resize(n, {0, 0, 0});
+  velocity_.resize(n, {0, 0, 0});
+  acceleration_.resize(n, constants::EXTERNAL_ACCELERATION<T>());
+  density_.resize(n, T{});
+}
+
+// Range [first,last) of particles within a storage shared by many cells.
+template <typename S>
+class storage_range {
+public:
+  using value_type = typename S::value_type;
+  using reference = decltype(std::declval<S &>()[0]);
+  using const_reference = decltype(std::declval<const S &>()[0]);
+
+  storage_range() : storage_{nullptr}, first_{0}, last_{0} {}
+
+  void assign(S & s, size_t first, size_t last) {
+    storage_ = &s;
+    first_ = first;
+    last_ = last;
+  }
+
+  size_t size() const { return last_ - first_; }
+
+  reference operator[](size_t i) { return (*storage_)[first_ + i]; }
+  const_reference operator[](size_t i) const { return static_cast<const S &>(*storage_)[first_ + i]; }
+
+  // Only available for storages providing blocks
+  template <typename U = S>
+  auto block() -> decltype(std::declval<U &>().block()) { return storage_->block().sub(first_, size()); }
+
+private:
+  S * storage_;
+  size_t first_;
+  size_t last_;
+};
+
+}
+
+#endif
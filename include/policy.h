@@ -2,21 +2,84 @@
 #define FLUID_POLICY_H
 
 #include "cell.h"
+#include "execution.h"
+#include "cell_order.h"
+#include "math_policy.h"
 #include <yapl/policy.h>
 #include <yapl/tbbexecutor.h>
 
 namespace fluid {
 
-template <typename T, bool cfl>
+enum class grid_layout {
+  cells,      // Every cell owns its particles
+  contiguous, // A single buffer of particles sorted by cell
+  migrating   // Every cell owns its particles, which are updated in place
+};
+
+enum class kernel_mode {
+  pairwise, // One pair of particles at a time
+  simd,     // Batches of particles from structure of arrays storage
+  verlet,   // Pairs from neighbour lists reused across frames
+  gather    // Every particle from all its neighbours, writing only itself
+};
+
+enum class cell_scheduling {
+  locked,   // Any cells in parallel, locking pairs of cells
+  coloured, // One of 27 colours at a time, without locks
+  buffered  // Contributions to neighbour cells in per thread buffers,
+            // merged in a fixed order after every pass
+};
+
+enum class frame_phases {
+  separate, // One sweep over all particles per phase
+  fused,    // Collisions, integration and next cells in a single sweep
+  graph,    // Fused phases of blocks of cells, each starting as soon as
+            // the blocks it depends on are done
+  wavefront // Graph phases of one cell thick slabs of blocks, queued slab
+            // by slab so that a slab goes through all phases while it and
+            // its neighbours are still in cache
+};
+
+template <typename S, grid_layout L>
+using cell_storage = typename std::conditional<L==grid_layout::contiguous,
+    storage_range<S>, S>::type;
+
+template <typename T, bool cfl, template <typename> class S = aos_storage,
+          grid_layout L = grid_layout::cells, cell_order O = cell_order::linear,
+          kernel_mode K = kernel_mode::pairwise,
+          cell_scheduling C = cell_scheduling::locked,
+          frame_phases F = frame_phases::separate,
+          typename M = exact_math>
 struct sequential_policy {
-  using cell_type = cell<T, null_mutex, cfl>;
+  static constexpr grid_layout layout = L;
+  static constexpr cell_order order = O;
+  static constexpr kernel_mode kernel = K;
+  static constexpr cell_scheduling scheduling = C;
+  static constexpr frame_phases phases = F;
+  using math = M;
+  using storage_type = S<T>;
+  using cell_type = cell<T, null_mutex, cfl, cell_storage<S<T>,L>>;
   using grid_policy = yapl::default_policy<cell_type>;
+  using execution = sequential_execution;
 };
 
-template <typename T, bool cfl>
+template <typename T, bool cfl, template <typename> class S = aos_storage,
+          grid_layout L = grid_layout::cells, cell_order O = cell_order::linear,
+          kernel_mode K = kernel_mode::pairwise,
+          cell_scheduling C = cell_scheduling::locked,
+          frame_phases F = frame_phases::separate,
+          typename M = exact_math>
 struct tbb_policy {
-  using cell_type = cell<T, spin_mutex, cfl>;
+  static constexpr grid_layout layout = L;
+  static constexpr cell_order order = O;
+  static constexpr kernel_mode kernel = K;
+  static constexpr cell_scheduling scheduling = C;
+  static constexpr frame_phases phases = F;
+  using math = M;
+  using storage_type = S<T>;
+  using cell_type = cell<T, spin_mutex, cfl, cell_storage<S<T>,L>>;
   using grid_policy = yapl::policy<yapl::tbb_executor<cell_type>>;
+  using execution = tbb_execution;
 };
 
 }
@@ -0,0 +1,435 @@
+#ifndef FLUID_SIMD_KERNELS_H
+#define FLUID_SIMD_KERNELS_H
+
+#include "particle_storage.h"
+#include "instruction_set.h"
+#include "params.h"
+#include <algorithm>
+#include <cmath>
+
+#ifdef FLUID_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace fluid {
+
+// Batched kernels interact every particle i of block a with every particle j
+// of block b. Both blocks are updated (symmetric writes), as in basic_particle.
+// When b is a itself only pairs with j<i are visited.
+//
+// Vectorized kernels load up to one register width of b at a time and test
+// every particle of a against it. Lanes out of the smoothing radius are
+// masked and contributions to particle i are added with a horizontal sum.
+
+template <typename T>
+bool same_block(const soa_block<T> & a, const soa_block<T> & b)
+{
+  return a.px == b.px;
+}
+
+// Density contributions of particles j>=first of b.
+template <typename T>
+void density_rows(const soa_block<T> & a, const soa_block<T> & b, size_t first, T hsq)
+{
+  const bool self = same_block(a,b);
+  for (size_t i=0; i<a.size; ++i) {
+    const T x = a.px[i], y = a.py[i], z = a.pz[i];
+    const size_t last = self ? i : b.size;
+    T sum{};
+    for (size_t j=first; j<last; ++j) {
+      const T dx = x - b.px[j], dy = y - b.py[j], dz = z - b.pz[j];
+      const T distsq = dx * dx + dy * dy + dz * dz;
+      if (distsq < hsq) {
+        const T t = hsq - distsq;
+        const T tc = t * t * t;
+        sum += tc;
+        b.density[j] += tc;
+      }
+    }
+    a.density[i] += sum;
+  }
+}
+
+template <typename T>
+void density_scalar(const soa_block<T> & a, const soa_block<T> & b, T hsq)
+{
+  density_rows(a, b, 0, hsq);
+}
+
+// Accelerations exchanged with particles j>=first of b.
+// Same operations as basic_particle::transfer_acceleration.
+template <typename T>
+void force_rows(const soa_block<T> & a, const soa_block<T> & b, size_t first, const params<T> & prm)
+{
+  using namespace constants;
+  const bool self = same_block(a,b);
+  const T pc = prm.pressure_coeff_, vc = prm.viscosity_coeff_;
+  for (size_t i=0; i<a.size; ++i) {
+    const T x = a.px[i], y = a.py[i], z = a.pz[i];
+    const T vx = a.vx[i], vy = a.vy[i], vz = a.vz[i];
+    const T di = a.density[i];
+    const size_t last = self ? i : b.size;
+    T sx{}, sy{}, sz{};
+    for (size_t j=first; j<last; ++j) {
+      const T dx = x - b.px[j], dy = y - b.py[j], dz = z - b.pz[j];
+      const T distsq = dx * dx + dy * dy + dz * dz;
+      if (distsq < prm.hsq_) {
+        const T dist = std::sqrt(std::max(distsq, T(1e-12)));
+        const T hmr = prm.h_ - dist;
+        const T q = hmr * hmr / dist;
+        const T ds = di + b.density[j] - DOUBLE_REST_DENSITY<T>();
+        const T dp = di * b.density[j];
+        const T ax = (dx * pc * q * ds + (b.vx[j] - vx) * vc * hmr) / dp;
+        const T ay = (dy * pc * q * ds + (b.vy[j] - vy) * vc * hmr) / dp;
+        const T az = (dz * pc * q * ds + (b.vz[j] - vz) * vc * hmr) / dp;
+        sx += ax; sy += ay; sz += az;
+        b.ax[j] -= ax; b.ay[j] -= ay; b.az[j] -= az;
+      }
+    }
+    a.ax[i] += sx;
+    a.ay[i] += sy;
+    a.az[i] += sz;
+  }
+}
+
+template <typename T>
+void force_scalar(const soa_block<T> & a, const soa_block<T> & b, const params<T> & prm)
+{
+  force_rows(a, b, 0, prm);
+}
+
+#ifdef FLUID_X86_SIMD
+
+__attribute__((target("sse4.2")))
+inline float horizontal_sum(__m128 v)
+{
+  v = _mm_hadd_ps(v, v);
+  v = _mm_hadd_ps(v, v);
+  return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("avx2")))
+inline float horizontal_sum(__m256 v)
+{
+  return horizontal_sum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+// Zero masked extraction avoids spurious uninitialized warnings
+// raised by some compilers on the unmasked intrinsic.
+__attribute__((target("avx512f")))
+inline float horizontal_sum(__m512 v)
+{
+  const __m256 lo = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xf, _mm512_castps_pd(v), 0));
+  const __m256 hi = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xf, _mm512_castps_pd(v), 1));
+  return horizontal_sum(_mm256_add_ps(lo, hi));
+}
+
+// Lanes k of a register starting at particle j with j+k < i.
+__attribute__((target("sse4.2")))
+inline __m128 lanes_before(size_t i, size_t j)
+{
+  const __m128i k = _mm_setr_epi32(0, 1, 2, 3);
+  return _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(static_cast<int>(i - j)), k));
+}
+
+__attribute__((target("avx2")))
+inline __m256 lanes_before_avx2(size_t i, size_t j)
+{
+  const __m256i k = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(i - j)), k));
+}
+
+inline __mmask16 first_lanes(size_t n)
+{
+  return (n >= 16) ? __mmask16(0xffff) : static_cast<__mmask16>((1u << n) - 1);
+}
+
+__attribute__((target("sse4.2")))
+inline void density_sse42(const soa_block<float> & a, const soa_block<float> & b, float hsq)
+{
+  const bool self = same_block(a,b);
+  const __m128 h = _mm_set1_ps(hsq);
+  size_t j = 0;
+  for (; j+4 <= b.size; j+=4) {
+    const __m128 bx = _mm_loadu_ps(b.px + j), by = _mm_loadu_ps(b.py + j), bz = _mm_loadu_ps(b.pz + j);
+    __m128 bd = _mm_setzero_ps();
+    for (size_t i = self ? j+1 : 0; i<a.size; ++i) {
+      const __m128 dx = _mm_sub_ps(_mm_set1_ps(a.px[i]), bx);
+      const __m128 dy = _mm_sub_ps(_mm_set1_ps(a.py[i]), by);
+      const __m128 dz = _mm_sub_ps(_mm_set1_ps(a.pz[i]), bz);
+      const __m128 distsq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx), _mm_mul_ps(dy,dy)), _mm_mul_ps(dz,dz));
+      __m128 mask = _mm_cmplt_ps(distsq, h);
+      if (self && i < j+4) mask = _mm_and_ps(mask, lanes_before(i,j));
+      if (_mm_movemask_ps(mask) == 0) continue;
+      const __m128 t = _mm_sub_ps(h, distsq);
+      const __m128 tc = _mm_and_ps(mask, _mm_mul_ps(_mm_mul_ps(t,t), t));
+      bd = _mm_add_ps(bd, tc);
+      a.density[i] += horizontal_sum(tc);
+    }
+    _mm_storeu_ps(b.density + j, _mm_add_ps(_mm_loadu_ps(b.density + j), bd));
+  }
+  density_rows(a, b, j, hsq);
+}
+
+__attribute__((target("avx2")))
+inline void density_avx2(const soa_block<float> & a, const soa_block<float> & b, float hsq)
+{
+  const bool self = same_block(a,b);
+  const __m256 h = _mm256_set1_ps(hsq);
+  size_t j = 0;
+  for (; j+8 <= b.size; j+=8) {
+    const __m256 bx = _mm256_loadu_ps(b.px + j), by = _mm256_loadu_ps(b.py + j), bz = _mm256_loadu_ps(b.pz + j);
+    __m256 bd = _mm256_setzero_ps();
+    for (size_t i = self ? j+1 : 0; i<a.size; ++i) {
+      const __m256 dx = _mm256_sub_ps(_mm256_set1_ps(a.px[i]), bx);
+      const __m256 dy = _mm256_sub_ps(_mm256_set1_ps(a.py[i]), by);
+      const __m256 dz = _mm256_sub_ps(_mm256_set1_ps(a.pz[i]), bz);
+      const __m256 distsq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx,dx), _mm256_mul_ps(dy,dy)), _mm256_mul_ps(dz,dz));
+      __m256 mask = _mm256_cmp_ps(distsq, h, _CMP_LT_OQ);
+      if (self && i < j+8) mask = _mm256_and_ps(mask, lanes_before_avx2(i,j));
+      if (_mm256_movemask_ps(mask) == 0) continue;
+      const __m256 t = _mm256_sub_ps(h, distsq);
+      const __m256 tc = _mm256_and_ps(mask, _mm256_mul_ps(_mm256_mul_ps(t,t), t));
+      bd = _mm256_add_ps(bd, tc);
+      a.density[i] += horizontal_sum(tc);
+    }
+    _mm256_storeu_ps(b.density + j, _mm256_add_ps(_mm256_loadu_ps(b.density + j), bd));
+  }
+  density_rows(a, b, j, hsq);
+}
+
+// Remaining lanes are handled with masked loads and stores.
+__attribute__((target("avx512f")))
+inline void density_avx512(const soa_block<float> & a, const soa_block<float> & b, float hsq)
+{
+  const bool self = same_block(a,b);
+  const __m512 h = _mm512_set1_ps(hsq);
+  for (size_t j=0; j<b.size; j+=16) {
+    const __mmask16 lanes = first_lanes(b.size - j);
+    const __m512 bx = _mm512_maskz_loadu_ps(lanes, b.px + j);
+    const __m512 by = _mm512_maskz_loadu_ps(lanes, b.py + j);
+    const __m512 bz = _mm512_maskz_loadu_ps(lanes, b.pz + j);
+    __m512 bd = _mm512_setzero_ps();
+    for (size_t i = self ? j+1 : 0; i<a.size; ++i) {
+      const __mmask16 near = (self && i < j+16) ? (lanes & first_lanes(i-j)) : lanes;
+      const __m512 dx = _mm512_sub_ps(_mm512_set1_ps(a.px[i]), bx);
+      const __m512 dy = _mm512_sub_ps(_mm512_set1_ps(a.py[i]), by);
+      const __m512 dz = _mm512_sub_ps(_mm512_set1_ps(a.pz[i]), bz);
+      const __m512 distsq = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx,dx), _mm512_mul_ps(dy,dy)), _mm512_mul_ps(dz,dz));
+      const __mmask16 mask = _mm512_mask_cmp_ps_mask(near, distsq, h, _CMP_LT_OQ);
+      if (mask == 0) continue;
+      const __m512 t = _mm512_sub_ps(h, distsq);
+      const __m512 tc = _mm512_maskz_mul_ps(mask, _mm512_mul_ps(t,t), t);
+      bd = _mm512_add_ps(bd, tc);
+      a.density[i] += horizontal_sum(tc);
+    }
+    const __m512 d = _mm512_maskz_loadu_ps(lanes, b.density + j);
+    _mm512_mask_storeu_ps(b.density + j, lanes, _mm512_add_ps(d, bd));
+  }
+}
+
+// Force kernels replace sqrt and division by a reciprocal square root
+// estimate refined with one Newton-Raphson step: r = r * (1.5 - 0.5 * d * r * r).
+// The division by the product of densities is kept.
+
+__attribute__((target("sse4.2")))
+inline void force_sse42(const soa_block<float> & a, const soa_block<float> & b, const params<float> & prm)
+{
+  using namespace constants;
+  const bool self = same_block(a,b);
+  const __m128 h = _mm_set1_ps(prm.h_), hsq = _mm_set1_ps(prm.hsq_);
+  const __m128 pc = _mm_set1_ps(prm.pressure_coeff_), vc = _mm_set1_ps(prm.viscosity_coeff_);
+  const __m128 rest = _mm_set1_ps(DOUBLE_REST_DENSITY<float>());
+  const __m128 eps = _mm_set1_ps(1e-12f), half = _mm_set1_ps(0.5f), three_halves = _mm_set1_ps(1.5f);
+  size_t j = 0;
+  for (; j+4 <= b.size; j+=4) {
+    const __m128 bx = _mm_loadu_ps(b.px + j), by = _mm_loadu_ps(b.py + j), bz = _mm_loadu_ps(b.pz + j);
+    const __m128 bvx = _mm_loadu_ps(b.vx + j), bvy = _mm_loadu_ps(b.vy + j), bvz = _mm_loadu_ps(b.vz + j);
+    const __m128 bd = _mm_loadu_ps(b.density + j);
+    __m128 bax = _mm_setzero_ps(), bay = _mm_setzero_ps(), baz = _mm_setzero_ps();
+    for (size_t i = self ? j+1 : 0; i<a.size; ++i) {
+      const __m128 dx = _mm_sub_ps(_mm_set1_ps(a.px[i]), bx);
+      const __m128 dy = _mm_sub_ps(_mm_set1_ps(a.py[i]), by);
+      const __m128 dz = _mm_sub_ps(_mm_set1_ps(a.pz[i]), bz);
+      const __m128 distsq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx,dx), _mm_mul_ps(dy,dy)), _mm_mul_ps(dz,dz));
+      __m128 mask = _mm_cmplt_ps(distsq, hsq);
+      if (self && i < j+4) mask = _mm_and_ps(mask, lanes_before(i,j));
+      if (_mm_movemask_ps(mask) == 0) continue;
+
+      const __m128 d = _mm_max_ps(distsq, eps);
+      __m128 r = _mm_rsqrt_ps(d);
+      r = _mm_mul_ps(r, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, d), _mm_mul_ps(r, r))));
+      const __m128 hmr = _mm_sub_ps(h, _mm_mul_ps(d, r));
+
+      const __m128 di = _mm_set1_ps(a.density[i]);
+      const __m128 p = _mm_mul_ps(_mm_mul_ps(pc, _mm_mul_ps(_mm_mul_ps(hmr, hmr), r)), _mm_sub_ps(_mm_add_ps(di, bd), rest));
+      const __m128 v = _mm_mul_ps(vc, hmr);
+      const __m128 inv = _mm_and_ps(mask, _mm_div_ps(_mm_set1_ps(1.0f), _mm_mul_ps(di, bd)));
+
+      const __m128 ax = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(dx, p), _mm_mul_ps(_mm_sub_ps(bvx, _mm_set1_ps(a.vx[i])), v)), inv);
+      const __m128 ay = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(dy, p), _mm_mul_ps(_mm_sub_ps(bvy, _mm_set1_ps(a.vy[i])), v)), inv);
+      const __m128 az = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(dz, p), _mm_mul_ps(_mm_sub_ps(bvz, _mm_set1_ps(a.vz[i])), v)), inv);
+      bax = _mm_add_ps(bax, ax);
+      bay = _mm_add_ps(bay, ay);
+      baz = _mm_add_ps(baz, az);
+      a.ax[i] += horizontal_sum(ax);
+      a.ay[i] += horizontal_sum(ay);
+      a.az[i] += horizontal_sum(az);
+    }
+    _mm_storeu_ps(b.ax + j, _mm_sub_ps(_mm_loadu_ps(b.ax + j), bax));
+    _mm_storeu_ps(b.ay + j, _mm_sub_ps(_mm_loadu_ps(b.ay + j), bay));
+    _mm_storeu_ps(b.az + j, _mm_sub_ps(_mm_loadu_ps(b.az + j), baz));
+  }
+  force_rows(a, b, j, prm);
+}
+
+__attribute__((target("avx2")))
+inline void force_avx2(const soa_block<float> & a, const soa_block<float> & b, const params<float> & prm)
+{
+  using namespace constants;
+  const bool self = same_block(a,b);
+  const __m256 h = _mm256_set1_ps(prm.h_), hsq = _mm256_set1_ps(prm.hsq_);
+  const __m256 pc = _mm256_set1_ps(prm.pressure_coeff_), vc = _mm256_set1_ps(prm.viscosity_coeff_);
+  const __m256 rest = _mm256_set1_ps(DOUBLE_REST_DENSITY<float>());
+  const __m256 eps = _mm256_set1_ps(1e-12f), half = _mm256_set1_ps(0.5f), three_halves = _mm256_set1_ps(1.5f);
+  size_t j = 0;
+  for (; j+8 <= b.size; j+=8) {
+    const __m256 bx = _mm256_loadu_ps(b.px + j), by = _mm256_loadu_ps(b.py + j), bz = _mm256_loadu_ps(b.pz + j);
+    const __m256 bvx = _mm256_loadu_ps(b.vx + j), bvy = _mm256_loadu_ps(b.vy + j), bvz = _mm256_loadu_ps(b.vz + j);
+    const __m256 bd = _mm256_loadu_ps(b.density + j);
+    __m256 bax = _mm256_setzero_ps(), bay = _mm256_setzero_ps(), baz = _mm256_setzero_ps();
+    for (size_t i = self ? j+1 : 0; i<a.size; ++i) {
+      const __m256 dx = _mm256_sub_ps(_mm256_set1_ps(a.px[i]), bx);
+      const __m256 dy = _mm256_sub_ps(_mm256_set1_ps(a.py[i]), by);
+      const __m256 dz = _mm256_sub_ps(_mm256_set1_ps(a.pz[i]), bz);
+      const __m256 distsq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx,dx), _mm256_mul_ps(dy,dy)), _mm256_mul_ps(dz,dz));
+      __m256 mask = _mm256_cmp_ps(distsq, hsq, _CMP_LT_OQ);
+      if (self && i < j+8) mask = _mm256_and_ps(mask, lanes_before_avx2(i,j));
+      if (_mm256_movemask_ps(mask) == 0) continue;
+
+      const __m256 d = _mm256_max_ps(distsq, eps);
+      __m256 r = _mm256_rsqrt_ps(d);
+      r = _mm256_mul_ps(r, _mm256_sub_ps(three_halves, _mm256_mul_ps(_mm256_mul_ps(half, d), _mm256_mul_ps(r, r))));
+      const __m256 hmr = _mm256_sub_ps(h, _mm256_mul_ps(d, r));
+
+      const __m256 di = _mm256_set1_ps(a.density[i]);
+      const __m256 p = _mm256_mul_ps(_mm256_mul_ps(pc, _mm256_mul_ps(_mm256_mul_ps(hmr, hmr), r)), _mm256_sub_ps(_mm256_add_ps(di, bd), rest));
+      const __m256 v = _mm256_mul_ps(vc, hmr);
+      const __m256 inv = _mm256_and_ps(mask, _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(di, bd)));
+
+      const __m256 ax = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dx, p), _mm256_mul_ps(_mm256_sub_ps(bvx, _mm256_set1_ps(a.vx[i])), v)), inv);
+      const __m256 ay = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dy, p), _mm256_mul_ps(_mm256_sub_ps(bvy, _mm256_set1_ps(a.vy[i])), v)), inv);
+      const __m256 az = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dz, p), _mm256_mul_ps(_mm256_sub_ps(bvz, _mm256_set1_ps(a.vz[i])), v)), inv);
+      bax = _mm256_add_ps(bax, ax);
+      bay = _mm256_add_ps(bay, ay);
+      baz = _mm256_add_ps(baz, az);
+      a.ax[i] += horizontal_sum(ax);
+      a.ay[i] += horizontal_sum(ay);
+      a.az[i] += horizontal_sum(az);
+    }
+    _mm256_storeu_ps(b.ax + j, _mm256_sub_ps(_mm256_loadu_ps(b.ax + j), bax));
+    _mm256_storeu_ps(b.ay + j, _mm256_sub_ps(_mm256_loadu_ps(b.ay + j), bay));
+    _mm256_storeu_ps(b.az + j, _mm256_sub_ps(_mm256_loadu_ps(b.az + j), baz));
+  }
+  force_rows(a, b, j, prm);
+}
+
+// The 14 bit estimate of AVX-512 is close to full precision after refinement.
+__attribute__((target("avx512f")))
+inline void force_avx512(const soa_block<float> & a, const soa_block<float> & b, const params<float> & prm)
+{
+  using namespace constants;
+  const bool self = same_block(a,b);
+  const __m512 h = _mm512_set1_ps(prm.h_), hsq = _mm512_set1_ps(prm.hsq_);
+  const __m512 pc = _mm512_set1_ps(prm.pressure_coeff_), vc = _mm512_set1_ps(prm.viscosity_coeff_);
+  const __m512 rest = _mm512_set1_ps(DOUBLE_REST_DENSITY<float>());
+  const __m512 eps = _mm512_set1_ps(1e-12f), half = _mm512_set1_ps(0.5f), three_halves = _mm512_set1_ps(1.5f);
+  for (size_t j=0; j<b.size; j+=16) {
+    const __mmask16 lanes = first_lanes(b.size - j);
+    const __m512 bx = _mm512_maskz_loadu_ps(lanes, b.px + j);
+    const __m512 by = _mm512_maskz_loadu_ps(lanes, b.py + j);
+    const __m512 bz = _mm512_maskz_loadu_ps(lanes, b.pz + j);
+    const __m512 bvx = _mm512_maskz_loadu_ps(lanes, b.vx + j);
+    const __m512 bvy = _mm512_maskz_loadu_ps(lanes, b.vy + j);
+    const __m512 bvz = _mm512_maskz_loadu_ps(lanes, b.vz + j);
+    const __m512 bd = _mm512_maskz_loadu_ps(lanes, b.density + j);
+    __m512 bax = _mm512_setzero_ps(), bay = _mm512_setzero_ps(), baz = _mm512_setzero_ps();
+    for (size_t i = self ? j+1 : 0; i<a.size; ++i) {
+      const __mmask16 near = (self && i < j+16) ? (lanes & first_lanes(i-j)) : lanes;
+      const __m512 dx = _mm512_sub_ps(_mm512_set1_ps(a.px[i]), bx);
+      const __m512 dy = _mm512_sub_ps(_mm512_set1_ps(a.py[i]), by);
+      const __m512 dz = _mm512_sub_ps(_mm512_set1_ps(a.pz[i]), bz);
+      const __m512 distsq = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx,dx), _mm512_mul_ps(dy,dy)), _mm512_mul_ps(dz,dz));
+      const __mmask16 mask = _mm512_mask_cmp_ps_mask(near, distsq, hsq, _CMP_LT_OQ);
+      if (mask == 0) continue;
+
+      const __m512 d = _mm512_maskz_max_ps(mask, distsq, eps);
+      __m512 r = _mm512_maskz_rsqrt14_ps(mask, d);
+      r = _mm512_mul_ps(r, _mm512_sub_ps(three_halves, _mm512_mul_ps(_mm512_mul_ps(half, d), _mm512_mul_ps(r, r))));
+      const __m512 hmr = _mm512_sub_ps(h, _mm512_mul_ps(d, r));
+
+      const __m512 di = _mm512_set1_ps(a.density[i]);
+      const __m512 p = _mm512_mul_ps(_mm512_mul_ps(pc, _mm512_mul_ps(_mm512_mul_ps(hmr, hmr), r)), _mm512_sub_ps(_mm512_add_ps(di, bd), rest));
+      const __m512 v = _mm512_mul_ps(vc, hmr);
+      const __m512 inv = _mm512_maskz_div_ps(mask, _mm512_set1_ps(1.0f), _mm512_mul_ps(di, bd));
+
+      const __m512 ax = _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(dx, p), _mm512_mul_ps(_mm512_sub_ps(bvx, _mm512_set1_ps(a.vx[i])), v)), inv);
+      const __m512 ay = _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(dy, p), _mm512_mul_ps(_mm512_sub_ps(bvy, _mm512_set1_ps(a.vy[i])), v)), inv);
+      const __m512 az = _mm512_mul_ps(_mm512_add_ps(_mm512_mul_ps(dz, p), _mm512_mul_ps(_mm512_sub_ps(bvz, _mm512_set1_ps(a.vz[i])), v)), inv);
+      bax = _mm512_add_ps(bax, ax);
+      bay = _mm512_add_ps(bay, ay);
+      baz = _mm512_add_ps(baz, az);
+      a.ax[i] += horizontal_sum(ax);
+      a.ay[i] += horizontal_sum(ay);
+      a.az[i] += horizontal_sum(az);
+    }
+    _mm512_mask_storeu_ps(b.ax + j, lanes, _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, b.ax + j), bax));
+    _mm512_mask_storeu_ps(b.ay + j, lanes, _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, b.ay + j), bay));
+    _mm512_mask_storeu_ps(b.az + j, lanes, _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, b.az + j), baz));
+  }
+}
+
+#endif
+
+// Kernels selected at run time for an instruction set.
+// Only single precision has vectorized kernels.
+template <typename T>
+struct simd_kernels {
+  using density_function = void (*)(const soa_block<T> &, const soa_block<T> &, T);
+  using force_function = void (*)(const soa_block<T> &, const soa_block<T> &, const params<T> &);
+
+  static density_function density(instruction_set) { return &density_scalar<T>; }
+  static force_function force(instruction_set) { return &force_scalar<T>; }
+};
+
+#ifdef FLUID_X86_SIMD
+
+template <>
+struct simd_kernels<float> {
+  using density_function = void (*)(const soa_block<float> &, const soa_block<float> &, float);
+  using force_function = void (*)(const soa_block<float> &, const soa_block<float> &, const params<float> &);
+
+  static density_function density(instruction_set isa) {
+    switch (isa) {
+      case instruction_set::avx512: return &density_avx512;
+      case instruction_set::avx2: return &density_avx2;
+      case instruction_set::sse42: return &density_sse42;
+      default: return &density_scalar<float>;
+    }
+  }
+
+  static force_function force(instruction_set isa) {
+    switch (isa) {
+      case instruction_set::avx512: return &force_avx512;
+      case instruction_set::avx2: return &force_avx2;
+      case instruction_set::sse42: return &force_sse42;
+      default: return &force_scalar<float>;
+    }
+  }
+};
+
+#endif
+
+}
+
+#endif
@@ -2,37 +2,59 @@
 #define FLUID_SIMULATION_H
 
 #include "grid.h"
+#include <xul/time_meter/optional_meter.h>
+#include <xul/time_meter/system_meter.h>
+#include <vector>
 
 namespace fluid {
 
 template <typename T, typename P>
 class simulation {
 public:
-  simulation(T ppm, size_t np);
+  simulation(T ppm, size_t np, int reorder_interval = 0, T verlet_skin = 0);
 
   size_t num_cells() const { return grid_.num_cells(); }
+  const domain<T> & cell_domain() const { return grid_.cell_domain(); }
 
   void advance_frame();
 
   void read(simulation_istream & is) { grid_.read(is, num_particles_); }
   void write(simulation_ostream & os) const;
 
+  // Particles in file order, simulation_ostream::PARTICLE_FLOATS floats each
+  void snapshot(std::vector<float> & values) const;
+
   void print_statistics() const;
 
+private:
+  void reorder_particles();
+
 private:
   const T particles_per_meter_;
   const size_t num_particles_;
 
+  // Particles are reordered every reorder_interval_ frames (0 = never)
+  const int reorder_interval_;
+  int frame_;
+
+  using meter_type = xul::time_meter::optional_meter<xul::time_meter::system_meter<std::chrono::system_clock>>;
+  meter_type reorder_meter_;
+  bool reordered_;
+
   grid<T,P> grid_;
 };
 
 
 template <typename T, typename P>
-simulation<T,P>::simulation(T ppm, size_t np)
+simulation<T,P>::simulation(T ppm, size_t np, int reorder_interval, T verlet_skin)
 :
 particles_per_meter_{ppm},
 num_particles_{np},
-grid_{ppm}
+reorder_interval_{reorder_interval},
+frame_{0},
+reorder_meter_{},
+reordered_{false},
+grid_{ppm, verlet_skin}
 {
 }
 
@@ -40,13 +62,35 @@ template <typename T, typename P>
 void simulation<T,P>::advance_frame()
 {
   grid_.rebuild_grid();
-  grid_.compute_forces();
-  grid_.process_collisions();
-  grid_.advance_particles();
-  grid_.reprocess_collisions();
+  reorder_particles();
+  if (P::phases == frame_phases::graph || P::phases == frame_phases::wavefront) {
+    grid_.run_frame_graph();
+  }
+  else if (P::phases == frame_phases::fused) {
+    grid_.compute_forces();
+    grid_.integrate();
+  }
+  else {
+    grid_.compute_forces();
+    grid_.process_collisions();
+    grid_.advance_particles();
+    grid_.reprocess_collisions();
+  }
   print_statistics();
 }
 
+template <typename T, typename P>
+void simulation<T,P>::reorder_particles()
+{
+  ++frame_;
+  reordered_ = reorder_interval_ > 0 && frame_ % reorder_interval_ == 0;
+  if (!reordered_) return;
+
+  reorder_meter_.start();
+  grid_.reorder_particles();
+  reorder_meter_.stop();
+}
+
 template <typename T, typename P>
 void simulation<T,P>::write(simulation_ostream & os) const
 {
@@ -54,6 +98,13 @@ void simulation<T,P>::write(simulation_ostream & os) const
   grid_.write(os);
 }
 
+template <typename T, typename P>
+void simulation<T,P>::snapshot(std::vector<float> & values) const
+{
+  values.resize(num_particles_ * simulation_ostream::PARTICLE_FLOATS);
+  grid_.encode(values.data());
+}
+
 template <typename T, typename P>
 void simulation<T,P>::print_statistics() const
 {
@@ -63,6 +114,13 @@ void simulation<T,P>::print_statistics() const
   grid_.get_statistics(mean,stddev,nempty);
   std::cout << "cell statistics: mean=" << mean << " particles, stddev=" << stddev << " particles." << std::endl;
   std::cout << "Empty cells: " << nempty << std::endl;
+  if (reordered_ && reorder_meter_.is_active()) {
+    std::cout << "Reordering time: " << reorder_meter_.count<std::chrono::microseconds>() << std::endl;
+  }
+  std::cout << "Cell storage allocations: " << grid_.num_allocations() << std::endl;
+  if (P::kernel == kernel_mode::verlet) {
+    std::cout << "Neighbour list builds: " << grid_.num_list_builds() << std::endl;
+  }
 #endif
 }
 
@@ -2,104 +2,358 @@
 #define FLUID_SIMULATION_STREAM_H
 
 #include "space_vector.h"
-#include <xul/endian/endian_converter.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
 #include <stdexcept>
 #include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FLUID_POSIX_FILES
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define FLUID_LITTLE_ENDIAN_HOST
+#endif
 
 namespace fluid {
 
+// Input file mapped in memory. The header is validated against the size of
+// the file, and particles are decoded from the mapping in bulk.
 class simulation_istream {
 public:
   simulation_istream(const std::string & name);
+  ~simulation_istream();
+
+  simulation_istream(const simulation_istream &) = delete;
+  simulation_istream & operator=(const simulation_istream &) = delete;
+
   void read_header(float & ppm, unsigned int & np);
 
   template <typename F>
   space_vector<F> read_space_vector();
 
+  // Floats of a particle: position, hv and velocity
+  constexpr static int PARTICLE_FLOATS = 9;
+
+  // Decodes particles [first, first + n) counted from the read position,
+  // which does not move. Threads may decode different ranges at once.
+  void decode_particles(float * out, std::size_t first, std::size_t n) const;
+
+  // Moves the read position past the next n particles
+  void skip_particles(std::size_t n);
+
+private:
+  void read_floats(float * out, std::size_t n);
+  void check_available(std::size_t offset, std::size_t n) const;
+  static void decode_floats(const char * first, float * out, std::size_t n);
+
 private:
-  std::ifstream stream_;
-  using endian_type = xul::endian::endian_type;
-  xul::endian::static_endian_converter<endian_type::little> endian_;
+  const char * data_;
+  std::size_t size_;
+  std::size_t position_;
+#ifndef FLUID_POSIX_FILES
+  std::vector<char> buffer_;
+#endif
   constexpr static int INT_SIZE = 4;
   constexpr static int FLOAT_SIZE = 4;
+  constexpr static int HEADER_SIZE = FLOAT_SIZE + INT_SIZE;
 };
 
+// Output file written at explicit offsets. The header and space vectors
+// are appended through a buffer, and blocks of particles are written at
+// their final position, possibly by many threads at once.
 class simulation_ostream {
 public:
   simulation_ostream(const std::string & name);
+  ~simulation_ostream();
+
+  simulation_ostream(const simulation_ostream &) = delete;
+  simulation_ostream & operator=(const simulation_ostream &) = delete;
+
   void write_header(float ppm, unsigned int np);
   
   template <typename F>
   void write_space_vector(const space_vector<F> & v);
+
+  // Floats of a particle: position, hv and velocity
+  constexpr static int PARTICLE_FLOATS = 9;
+
+  // Writes particles [first, first + n) counted from the write position,
+  // which does not move. Threads may write different ranges at once.
+  void write_particles(const float * values, std::size_t first, std::size_t n) const;
+
+  // Moves the write position past the next n particles
+  void skip_particles(std::size_t n);
   
 private:
-  std::ofstream stream_;
-  using endian_type = xul::endian::endian_type;
-  xul::endian::static_endian_converter<endian_type::little> endian_;
+  void write_floats(const float * values, std::size_t n);
+  void flush();
+  void write_at(const char * data, std::size_t n, std::size_t offset) const;
+  static void encode_floats(const float * values, char * out, std::size_t n);
+
+private:
+#ifdef FLUID_POSIX_FILES
+  int fd_;
+#else
+  mutable std::ofstream stream_;
+  mutable std::mutex stream_mutex_;
+#endif
+  // Bytes not yet written, which end at the write position
+  std::vector<char> buffer_;
+  std::size_t position_;
+  constexpr static std::size_t BUFFER_SIZE = 1 << 16;
   constexpr static int INT_SIZE = 4;
   constexpr static int FLOAT_SIZE = 4;
 };
 
 simulation_istream::simulation_istream(const std::string & name)
 :
-stream_(name, std::ios::binary)
+data_{nullptr},
+size_{0},
+position_{0}
 {
-  if (!stream_) {
+#ifdef FLUID_POSIX_FILES
+  int fd = ::open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Error opening input file");
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Error opening input file");
+  }
+  size_ = static_cast<std::size_t>(st.st_size);
+  if (size_ > 0) {
+    void * p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error("Error mapping input file");
+    }
+    // Particles are read once from first to last
+    ::madvise(p, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const char *>(p);
+  }
+  ::close(fd);
+#else
+  std::ifstream stream(name, std::ios::binary);
+  if (!stream) {
     throw std::runtime_error("Error opening input file");
   }
+  buffer_.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+#endif
+}
+
+simulation_istream::~simulation_istream()
+{
+#ifdef FLUID_POSIX_FILES
+  if (data_) {
+    ::munmap(const_cast<char *>(data_), size_);
+  }
+#endif
 }
 
 void simulation_istream::read_header(float & ppm, unsigned int & np) {
-  using namespace xul::endian;
+  static_assert(sizeof(ppm) == FLOAT_SIZE, "Unsupported size for particles per meter");
+  static_assert(sizeof(np) == INT_SIZE, "Unsupported size for number of particles");
 
-  byte_sequence<FLOAT_SIZE> ppm_seq;
-  ppm_seq.read(stream_);
-  ppm = endian_.to_host<float>(ppm_seq);
+  if (size_ < HEADER_SIZE) {
+    throw std::runtime_error("Input file too short for header");
+  }
+  read_floats(&ppm, 1);
+  const auto * b = reinterpret_cast<const unsigned char *>(data_ + position_);
+  np = static_cast<unsigned int>(b[0]) | static_cast<unsigned int>(b[1]) << 8 |
+       static_cast<unsigned int>(b[2]) << 16 | static_cast<unsigned int>(b[3]) << 24;
+  position_ += INT_SIZE;
 
-  byte_sequence<INT_SIZE> np_seq;
-  np_seq.read(stream_);
-  np = endian_.to_host<unsigned int>(np_seq);
+  if (!(ppm > 0)) {
+    throw std::runtime_error("Invalid particles per meter in input file");
+  }
+  if ((size_ - HEADER_SIZE) / (PARTICLE_FLOATS * FLOAT_SIZE) != np ||
+      (size_ - HEADER_SIZE) % (PARTICLE_FLOATS * FLOAT_SIZE) != 0) {
+    throw std::runtime_error("Size of input file does not match number of particles");
+  }
 }
 
 template <class F>
 space_vector<F> simulation_istream::read_space_vector() {
-  using namespace xul::endian;
-  byte_sequence<FLOAT_SIZE> x, y, z;
-  x.read(stream_);
-  y.read(stream_);
-  z.read(stream_);
-  return space_vector<F>{
-    endian_.to_host<float>(x),
-    endian_.to_host<float>(y),
-    endian_.to_host<float>(z)
-  }; 
+  float v[3];
+  read_floats(v, 3);
+  return space_vector<F>{v[0], v[1], v[2]};
+}
+
+void simulation_istream::decode_particles(float * out, std::size_t first, std::size_t n) const {
+  const std::size_t offset = first * PARTICLE_FLOATS * FLOAT_SIZE;
+  check_available(offset, n * PARTICLE_FLOATS);
+  decode_floats(data_ + position_ + offset, out, n * PARTICLE_FLOATS);
+}
+
+void simulation_istream::skip_particles(std::size_t n) {
+  check_available(0, n * PARTICLE_FLOATS);
+  position_ += n * PARTICLE_FLOATS * FLOAT_SIZE;
+}
+
+void simulation_istream::read_floats(float * out, std::size_t n) {
+  check_available(0, n);
+  decode_floats(data_ + position_, out, n);
+  position_ += n * FLOAT_SIZE;
+}
+
+// Throws unless n floats follow offset bytes past the read position
+void simulation_istream::check_available(std::size_t offset, std::size_t n) const {
+  const std::size_t left = size_ - position_;
+  if (offset > left || n * FLOAT_SIZE > left - offset) {
+    throw std::runtime_error("Unexpected end of input file");
+  }
+}
+
+void simulation_istream::decode_floats(const char * first, float * out, std::size_t n) {
+#ifdef FLUID_LITTLE_ENDIAN_HOST
+  std::memcpy(out, first, n * FLOAT_SIZE);
+#else
+  const auto * b = reinterpret_cast<const unsigned char *>(first);
+  for (std::size_t i = 0; i < n; ++i, b += FLOAT_SIZE) {
+    const std::uint32_t u = static_cast<std::uint32_t>(b[0]) | static_cast<std::uint32_t>(b[1]) << 8 |
+                            static_cast<std::uint32_t>(b[2]) << 16 | static_cast<std::uint32_t>(b[3]) << 24;
+    std::memcpy(out + i, &u, FLOAT_SIZE);
+  }
+#endif
 }
 
 simulation_ostream::simulation_ostream(const std::string & name)
 :
-stream_(name, std::ios::binary)
+#ifdef FLUID_POSIX_FILES
+fd_{::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666)},
+#else
+stream_(name, std::ios::binary),
+stream_mutex_{},
+#endif
+buffer_{},
+position_{0}
 {
+#ifdef FLUID_POSIX_FILES
+  if (fd_ < 0) {
+#else
   if (!stream_) {
+#endif
     throw std::runtime_error("Error opening output file");
   }
+  buffer_.reserve(BUFFER_SIZE);
+}
+
+simulation_ostream::~simulation_ostream()
+{
+  // Errors cannot be reported from here, as with std::ofstream
+  try {
+    flush();
+  }
+  catch (const std::runtime_error &) {
+  }
+#ifdef FLUID_POSIX_FILES
+  ::close(fd_);
+#endif
 }
 
 void simulation_ostream::write_header(float ppm, unsigned int np) {
   static_assert(sizeof(ppm) == FLOAT_SIZE, "Unsupported size for particles per meter");
   static_assert(sizeof(np) == INT_SIZE, "Unsupported size for number of particles");
 
-  using namespace xul::endian;
-
-  endian_.from_host<float>(ppm).write(stream_);
-  endian_.from_host<unsigned>(np).write(stream_);
+  write_floats(&ppm, 1);
+  for (int i = 0; i < INT_SIZE; ++i) {
+    buffer_.push_back(static_cast<char>((np >> (8 * i)) & 0xffu));
+  }
+  position_ += INT_SIZE;
 }
 
 template <class F>
 void simulation_ostream::write_space_vector(const space_vector<F> & v)
 {
-  endian_.from_host<float>(v.x()).write(stream_);
-  endian_.from_host<float>(v.y()).write(stream_);
-  endian_.from_host<float>(v.z()).write(stream_);
+  const float values[3] = {
+    static_cast<float>(v.x()), static_cast<float>(v.y()), static_cast<float>(v.z())
+  };
+  write_floats(values, 3);
+}
+
+void simulation_ostream::write_particles(const float * values, std::size_t first, std::size_t n) const {
+  const std::size_t offset = position_ + first * PARTICLE_FLOATS * FLOAT_SIZE;
+#ifdef FLUID_LITTLE_ENDIAN_HOST
+  write_at(reinterpret_cast<const char *>(values), n * PARTICLE_FLOATS * FLOAT_SIZE, offset);
+#else
+  std::vector<char> bytes(n * PARTICLE_FLOATS * FLOAT_SIZE);
+  encode_floats(values, bytes.data(), n * PARTICLE_FLOATS);
+  write_at(bytes.data(), bytes.size(), offset);
+#endif
+}
+
+void simulation_ostream::skip_particles(std::size_t n) {
+  // Buffered bytes must end at the write position
+  flush();
+  position_ += n * PARTICLE_FLOATS * FLOAT_SIZE;
+}
+
+void simulation_ostream::write_floats(const float * values, std::size_t n) {
+  if (buffer_.size() + n * FLOAT_SIZE > BUFFER_SIZE) {
+    flush();
+  }
+  const std::size_t size = buffer_.size();
+  buffer_.resize(size + n * FLOAT_SIZE);
+  encode_floats(values, buffer_.data() + size, n);
+  position_ += n * FLOAT_SIZE;
+}
+
+void simulation_ostream::flush() {
+  if (!buffer_.empty()) {
+    write_at(buffer_.data(), buffer_.size(), position_ - buffer_.size());
+    buffer_.clear();
+  }
+}
+
+void simulation_ostream::write_at(const char * data, std::size_t n, std::size_t offset) const {
+#ifdef FLUID_POSIX_FILES
+  while (n > 0) {
+    const ssize_t written = ::pwrite(fd_, data, n, static_cast<off_t>(offset));
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    // Nothing written for a non-empty range would never finish
+    if (written <= 0) {
+      throw std::runtime_error("Error writing output file");
+    }
+    data += written;
+    n -= static_cast<std::size_t>(written);
+    offset += static_cast<std::size_t>(written);
+  }
+#else
+  std::lock_guard<std::mutex> l{stream_mutex_};
+  stream_.seekp(static_cast<std::streamoff>(offset));
+  if (!stream_.write(data, static_cast<std::streamsize>(n))) {
+    throw std::runtime_error("Error writing output file");
+  }
+#endif
+}
+
+void simulation_ostream::encode_floats(const float * values, char * out, std::size_t n) {
+#ifdef FLUID_LITTLE_ENDIAN_HOST
+  std::memcpy(out, values, n * FLOAT_SIZE);
+#else
+  for (std::size_t i = 0; i < n; ++i) {
+    std::uint32_t u;
+    std::memcpy(&u, values + i, FLOAT_SIZE);
+    for (int b = 0; b < FLOAT_SIZE; ++b) {
+      *out++ = static_cast<char>((u >> (8 * b)) & 0xffu);
+    }
+  }
+#endif
 }
 
 }
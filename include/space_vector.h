@@ -43,7 +43,7 @@ public:
   template <int I>
   T get() const { return (I==0)?x_:((I==1)?y_:z_); }
 
-  T square_distance(space_vector & v) const { return (*this - v).norm(); }
+  T square_distance(const space_vector & v) const { return (*this - v).norm(); }
   T norm() const { return x_*x_ + y_*y_ + z_*z_; }
 
   constexpr T volume() const { return x_ * y_ * z_; }
@@ -57,7 +57,7 @@ public:
   space_vector &  operator += (space_vector const &v) { x_ += v.x_;  y_ += v.y_; z_ += v.z_; return *this; }
 
   template <typename U>
-  space_vector &  operator -= (space_vector<U> const &v) { x_ -= v.get<0>();  y_ -= v.get<1>(); z_ -= v.get<2>(); return *this; }
+  space_vector &  operator -= (space_vector<U> const &v) { x_ -= v.template get<0>();  y_ -= v.template get<1>(); z_ -= v.template get<2>(); return *this; }
 
   space_vector &  operator *= (T s)      { x_ *= s;  y_ *= s; z_ *= s; return *this; }
   space_vector &  operator /= (T s)      { T tmp = 1.f/s; x_ *= tmp;  y_ *= tmp; z_ *= tmp; return *this; }
@@ -78,4 +78,48 @@ public:
   friend O & operator<<(O & o, const space_vector & v) { return o << "( " << v.x_ << " , " << v.y_ << " , " << v.z_ << " )"; }
 };
 
+// Reference to a space vector whose components are stored in separate arrays.
+template <class T>
+class space_vector_ref
+{
+private:
+  T & x_;
+  T & y_;
+  T & z_;
+
+public:
+  T x() const { return x_; }
+  T y() const { return y_; }
+  T z() const { return z_; }
+
+  space_vector_ref(T & x, T & y, T & z) noexcept : x_(x), y_(y), z_(z) {}
+
+  space_vector_ref(const space_vector_ref & v) noexcept = default;
+  space_vector_ref & operator=(const space_vector_ref & v) = delete;
+
+  operator space_vector<T>() const { return space_vector<T>(x_, y_, z_); }
+
+  space_vector_ref & operator=(const space_vector<T> & v) { x_ = v.x(); y_ = v.y(); z_ = v.z(); return *this; }
+
+  template <int I>
+  T  & get() { return (I==0)?x_:((I==1)?y_:z_); }
+
+  template <int I>
+  T get() const { return (I==0)?x_:((I==1)?y_:z_); }
+
+  T square_distance(const space_vector_ref & v) const { return (*this - v).norm(); }
+  T norm() const { return x_*x_ + y_*y_ + z_*z_; }
+
+  space_vector_ref &  operator += (space_vector<T> const &v) { x_ += v.x();  y_ += v.y(); z_ += v.z(); return *this; }
+  space_vector_ref &  operator -= (space_vector<T> const &v) { x_ -= v.x();  y_ -= v.y(); z_ -= v.z(); return *this; }
+  space_vector_ref &  operator *= (T s)      { x_ *= s;  y_ *= s; z_ *= s; return *this; }
+
+  space_vector<T>    operator + (space_vector<T> const &v) const    { return space_vector<T>(x_+v.x(), y_+v.y(), z_+v.z()); }
+  space_vector<T>    operator - (space_vector_ref const &v) const    { return space_vector<T>(x_-v.x_, y_-v.y_, z_-v.z_); }
+  space_vector<T>    operator * (T s) const         { return space_vector<T>(x_*s, y_*s, z_*s); }
+
+  template <class O>
+  friend O & operator<<(O & o, const space_vector_ref & v) { return o << space_vector<T>(v); }
+};
+
 #endif
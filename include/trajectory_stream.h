@@ -0,0 +1,715 @@
+#ifndef FLUID_TRAJECTORY_STREAM_H
+#define FLUID_TRAJECTORY_STREAM_H
+
+#include "simulation_stream.h"
+#include "domain.h"
+#include "half_float.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace fluid {
+
+// Name without its .fluid extension
+inline std::string fluid_file_stem(const std::string & name)
+{
+  const std::string extension = ".fluid";
+  if (name.size() > extension.size() &&
+      name.compare(name.size() - extension.size(), extension.size(), extension) == 0) {
+    return name.substr(0, name.size() - extension.size());
+  }
+  return name;
+}
+
+// Snapshot of frame 25 of out.fluid goes to out_000025.fluid
+inline std::string snapshot_file_name(const std::string & name, int frame)
+{
+  char suffix[16];
+  std::snprintf(suffix, sizeof(suffix), "_%06d", frame);
+  return fluid_file_stem(name) + suffix + ".fluid";
+}
+
+// Compact trajectory of out.fluid goes to out.ftraj
+inline std::string trajectory_file_name(const std::string & name)
+{
+  return fluid_file_stem(name) + ".ftraj";
+}
+
+// Compact trajectory files hold many frames of a simulation. Positions are
+// quantized to 2^position_bits steps per grid cell and axis, and hv and
+// velocities to steps of 2^-velocity_bits. Particles are matched with a
+// particle of the previous frame in the same or a neighbour cell, which
+// predicts hv, and positions advanced by hv over time_step per frame. The
+// residuals are entropy coded with adaptive Golomb-Rice codes. Decoded
+// values are within the bounds of the header.
+struct trajectory_header {
+  float ppm;
+  unsigned int np;
+  float time_step;
+  float min[3];
+  float delta[3];
+  std::uint32_t size[3];
+  std::uint32_t position_bits;
+  std::uint32_t velocity_bits;
+  float position_bound;
+  float velocity_bound;
+};
+
+// Bits appended to a byte buffer, least significant bit first
+class bit_writer {
+public:
+  explicit bit_writer(std::vector<unsigned char> & bytes) : bytes_(bytes), bits_{0}, count_{0} {}
+
+  // Writes the n <= 32 lowest bits of v
+  void write(std::uint64_t v, int n) {
+    bits_ |= (v & ((std::uint64_t{1} << n) - 1)) << count_;
+    count_ += n;
+    while (count_ >= 8) {
+      bytes_.push_back(static_cast<unsigned char>(bits_));
+      bits_ >>= 8;
+      count_ -= 8;
+    }
+  }
+
+  void flush() {
+    if (count_ > 0) {
+      bytes_.push_back(static_cast<unsigned char>(bits_));
+      bits_ = 0;
+      count_ = 0;
+    }
+  }
+
+private:
+  std::vector<unsigned char> & bytes_;
+  std::uint64_t bits_;
+  int count_;
+};
+
+class bit_reader {
+public:
+  bit_reader(const unsigned char * data, std::size_t size) : data_{data}, size_{size}, bits_{0}, count_{0} {}
+
+  // Reads n <= 32 bits
+  std::uint64_t read(int n) {
+    while (count_ < n) {
+      if (size_ == 0) {
+        throw std::runtime_error("Truncated trajectory frame");
+      }
+      bits_ |= static_cast<std::uint64_t>(*data_++) << count_;
+      --size_;
+      count_ += 8;
+    }
+    const std::uint64_t v = bits_ & ((std::uint64_t{1} << n) - 1);
+    bits_ >>= n;
+    count_ -= n;
+    return v;
+  }
+
+private:
+  const unsigned char * data_;
+  std::size_t size_;
+  std::uint64_t bits_;
+  int count_;
+};
+
+// Adaptive Golomb-Rice code of non-negative integers. The parameter
+// follows the mean of recent values, and values with long quotients are
+// escaped to 64 raw bits.
+class rice_channel {
+public:
+  void encode(bit_writer & w, std::uint64_t v) {
+    const int k = parameter();
+    const std::uint64_t q = v >> k;
+    if (q < ESCAPE) {
+      w.write((std::uint64_t{1} << q) - 1, static_cast<int>(q) + 1);
+      write_bits(w, v, k);
+    }
+    else {
+      w.write((std::uint64_t{1} << ESCAPE) - 1, ESCAPE);
+      write_bits(w, v, 64);
+    }
+    update(v);
+  }
+
+  std::uint64_t decode(bit_reader & r) {
+    const int k = parameter();
+    std::uint64_t q = 0;
+    while (q < ESCAPE && r.read(1) != 0) {
+      ++q;
+    }
+    const std::uint64_t v = (q < ESCAPE) ? (q << k) | read_bits(r, k) : read_bits(r, 64);
+    update(v);
+    return v;
+  }
+
+private:
+  int parameter() const {
+    int k = 0;
+    while (k < 56 && (count_ << k) < sum_) {
+      ++k;
+    }
+    return k;
+  }
+
+  void update(std::uint64_t v) {
+    sum_ += std::min<std::uint64_t>(v, std::uint64_t{1} << 40);
+    if (++count_ == 32) {
+      sum_ >>= 1;
+      count_ >>= 1;
+    }
+  }
+
+  static void write_bits(bit_writer & w, std::uint64_t v, int n) {
+    if (n > 32) {
+      w.write(v, 32);
+      w.write(v >> 32, n - 32);
+    }
+    else {
+      w.write(v, n);
+    }
+  }
+
+  static std::uint64_t read_bits(bit_reader & r, int n) {
+    if (n > 32) {
+      const std::uint64_t low = r.read(32);
+      return low | (r.read(n - 32) << 32);
+    }
+    return r.read(n);
+  }
+
+private:
+  static constexpr int ESCAPE = 24;
+  std::uint64_t sum_ = 16;
+  std::uint64_t count_ = 1;
+};
+
+// Arithmetic on quantized values wraps around, so that corrupt files decode
+// to wrong values instead of overflowing
+inline std::int64_t wrapping_add(std::int64_t a, std::int64_t b)
+{
+  return static_cast<std::int64_t>(static_cast<std::uint64_t>(a) + static_cast<std::uint64_t>(b));
+}
+
+inline std::int64_t wrapping_sub(std::int64_t a, std::int64_t b)
+{
+  return static_cast<std::int64_t>(static_cast<std::uint64_t>(a) - static_cast<std::uint64_t>(b));
+}
+
+inline std::int64_t wrapping_mul(std::int64_t a, std::int64_t b)
+{
+  return static_cast<std::int64_t>(static_cast<std::uint64_t>(a) * static_cast<std::uint64_t>(b));
+}
+
+// Quantized particle: cell, position on the lattice of cell steps over the
+// domain, hv and velocity
+struct quantized_particle {
+  std::int64_t cell;
+  std::int64_t q[9];
+  // Change of hv since the match in the previous frame
+  std::int64_t dhv[3];
+};
+
+// Order in which values of a particle are coded: hv, velocity, position.
+// Predictions of later values use the earlier ones.
+constexpr int TRAJECTORY_ORDER[9] = {3, 4, 5, 6, 7, 8, 0, 1, 2};
+
+// Predicts particles from a matching particle of the previous frame.
+// Particles have no identity, so the writer chooses the match among the
+// previous particles of the same and the neighbour cells, and codes its
+// index in the candidates. Candidates start with the particle of the same
+// rank in the same cell, which matches when frames keep the order of the
+// grid. Particles without a match are predicted from the particle before
+// them and the centre of their cell.
+class trajectory_predictor {
+public:
+  explicit trajectory_predictor(const trajectory_header & h)
+  :
+  h_(h),
+  first_(std::size_t{h.size[0]} * h.size[1] * h.size[2] + 1, 0),
+  rank_(first_.size() - 1, 0)
+  {}
+
+  void begin_frame(int frame, std::size_t np) {
+    // Lattice steps moved per time step and half step of hv
+    for (int d = 0; d < 3; ++d) {
+      advance_[d] = h_.time_step * std::ldexp(1.0, static_cast<int>(h_.position_bits)) /
+                    (2.0 * h_.delta[d] * std::ldexp(1.0, static_cast<int>(h_.velocity_bits)));
+    }
+    steps_ = std::max<std::int64_t>(std::int64_t{frame} - frame_, 1);
+    frame_ = frame;
+    current_.clear();
+    current_.reserve(np);
+    std::fill(rank_.begin(), rank_.end(), 0);
+  }
+
+  std::size_t num_cells() const { return rank_.size(); }
+
+  // Collects the candidate matches of the next particle, in the given cell:
+  // particles of the cell from its next rank on, the rest of the cell, and
+  // the particles of the neighbour cells
+  void next(std::int64_t cell) {
+    candidates_.clear();
+    const std::size_t rank = first_[cell] + rank_[cell]++;
+    for (std::size_t k = rank; k < first_[cell + 1]; ++k) {
+      candidates_.push_back(&previous_[k]);
+    }
+    for (std::size_t k = first_[cell]; k < std::min(rank, first_[cell + 1]); ++k) {
+      candidates_.push_back(&previous_[k]);
+    }
+    const std::int64_t c[3] = {
+      cell % h_.size[0], (cell / h_.size[0]) % h_.size[1], cell / (std::int64_t{h_.size[0]} * h_.size[1])
+    };
+    for (std::int64_t z = std::max<std::int64_t>(c[2] - 1, 0); z <= std::min<std::int64_t>(c[2] + 1, h_.size[2] - 1); ++z) {
+      for (std::int64_t y = std::max<std::int64_t>(c[1] - 1, 0); y <= std::min<std::int64_t>(c[1] + 1, h_.size[1] - 1); ++y) {
+        for (std::int64_t x = std::max<std::int64_t>(c[0] - 1, 0); x <= std::min<std::int64_t>(c[0] + 1, h_.size[0] - 1); ++x) {
+          const std::int64_t n = (z * h_.size[1] + y) * h_.size[0] + x;
+          if (n != cell) {
+            for (std::size_t k = first_[n]; k < first_[n + 1]; ++k) {
+              candidates_.push_back(&previous_[k]);
+            }
+          }
+        }
+      }
+    }
+    match_ = nullptr;
+  }
+
+  // Match of p with the smallest position residuals: 0 for none, or one
+  // plus its index in the candidates
+  std::size_t choose(const quantized_particle & p) const {
+    std::size_t best = 0;
+    std::uint64_t best_cost = cost(p, nullptr);
+    for (std::size_t i = 0; i < candidates_.size() && best_cost > 3; ++i) {
+      const std::uint64_t c = cost(p, candidates_[i]);
+      if (c < best_cost) {
+        best = i + 1;
+        best_cost = c;
+      }
+    }
+    return best;
+  }
+
+  void select(std::size_t match) {
+    if (match > candidates_.size()) {
+      throw std::runtime_error("Invalid trajectory particle match");
+    }
+    match_ = (match == 0) ? nullptr : candidates_[match - 1];
+  }
+
+  // Prediction of value k of p, whose values before k in coding order are set
+  std::int64_t predict(const quantized_particle & p, int k) const { return predict(p, k, match_); }
+
+  void add(quantized_particle p) {
+    for (int d = 0; d < 3; ++d) {
+      p.dhv[d] = match_ ? wrapping_sub(p.q[d + 3], match_->q[d + 3]) : 0;
+    }
+    current_.push_back(p);
+  }
+
+  // Keeps the frame as previous frame, sorted by cell in frame order
+  void end_frame() {
+    std::fill(first_.begin(), first_.end(), 0);
+    for (const auto & p : current_) {
+      ++first_[p.cell + 1];
+    }
+    std::partial_sum(first_.begin(), first_.end(), first_.begin());
+    std::fill(rank_.begin(), rank_.end(), 0);
+    previous_.resize(current_.size());
+    for (const auto & p : current_) {
+      previous_[first_[p.cell] + rank_[p.cell]++] = p;
+    }
+  }
+
+private:
+  // Particles advance by hv of each time step, and their velocity is the
+  // mean of hv before and after the step. Over several time steps between
+  // frames, hv is taken to change linearly, and its change to repeat.
+  std::int64_t predict(const quantized_particle & p, int k, const quantized_particle * m) const {
+    if (k >= 6) {
+      const std::int64_t hv = p.q[k - 3];
+      return m ? wrapping_sub(hv, wrapping_sub(hv, m->q[k - 3]) / (2 * steps_)) : hv;
+    }
+    if (k >= 3) {
+      return m ? wrapping_add(m->q[k], m->dhv[k - 3]) : (current_.empty() ? 0 : current_.back().q[k]);
+    }
+    if (m) {
+      const std::int64_t hv = wrapping_add(wrapping_mul(steps_ + 1, p.q[k + 3]), wrapping_mul(steps_ - 1, m->q[k + 3]));
+      return wrapping_add(m->q[k], std::llround(hv * advance_[k]));
+    }
+    const std::int64_t c[3] = {
+      p.cell % h_.size[0], (p.cell / h_.size[0]) % h_.size[1], p.cell / (std::int64_t{h_.size[0]} * h_.size[1])
+    };
+    return ((c[k] * 2 + 1) << h_.position_bits) / 2;
+  }
+
+  std::uint64_t cost(const quantized_particle & p, const quantized_particle * m) const {
+    std::uint64_t c = 0;
+    for (int k = 0; k < 3; ++k) {
+      c += static_cast<std::uint64_t>(std::llabs(p.q[k] - predict(p, k, m)));
+    }
+    return c;
+  }
+
+private:
+  const trajectory_header h_;
+  // Start of each cell in the previous frame, and ranks in the frame
+  std::vector<std::size_t> first_;
+  std::vector<std::size_t> rank_;
+  std::vector<quantized_particle> previous_;
+  std::vector<quantized_particle> current_;
+  std::vector<const quantized_particle *> candidates_;
+  int frame_ = 0;
+  std::int64_t steps_ = 1;
+  double advance_[3] = {};
+  const quantized_particle * match_ = nullptr;
+};
+
+inline std::uint64_t zigzag(std::int64_t v)
+{
+  return (static_cast<std::uint64_t>(v) << 1) ^ static_cast<std::uint64_t>(v >> 63);
+}
+
+inline std::int64_t unzigzag(std::uint64_t u)
+{
+  return static_cast<std::int64_t>(u >> 1) ^ -static_cast<std::int64_t>(u & 1);
+}
+
+// Values of frames and headers, little-endian
+inline void put_u32(std::vector<unsigned char> & b, std::uint32_t v)
+{
+  for (int i = 0; i < 4; ++i) {
+    b.push_back(static_cast<unsigned char>(v >> (8 * i)));
+  }
+}
+
+inline void put_u64(std::vector<unsigned char> & b, std::uint64_t v)
+{
+  put_u32(b, static_cast<std::uint32_t>(v));
+  put_u32(b, static_cast<std::uint32_t>(v >> 32));
+}
+
+inline std::uint32_t get_u32(const unsigned char * b)
+{
+  return static_cast<std::uint32_t>(b[0]) | static_cast<std::uint32_t>(b[1]) << 8 |
+         static_cast<std::uint32_t>(b[2]) << 16 | static_cast<std::uint32_t>(b[3]) << 24;
+}
+
+inline std::uint64_t get_u64(const unsigned char * b)
+{
+  return get_u32(b) | static_cast<std::uint64_t>(get_u32(b + 4)) << 32;
+}
+
+// Quantization of particles, the same for writing and reading
+class trajectory_quantizer {
+public:
+  explicit trajectory_quantizer(const trajectory_header & h)
+  :
+  h_(h),
+  position_scale_{std::ldexp(1.0, static_cast<int>(h.position_bits))},
+  velocity_scale_{std::ldexp(1.0, static_cast<int>(h.velocity_bits))}
+  {}
+
+  quantized_particle quantize(const float * v) const {
+    quantized_particle p;
+    std::int64_t c[3];
+    for (int d = 0; d < 3; ++d) {
+      const double x = (static_cast<double>(v[d]) - h_.min[d]) / h_.delta[d];
+      const double cell = std::min(std::max(std::floor(x), 0.0), h_.size[d] - 1.0);
+      c[d] = static_cast<std::int64_t>(cell);
+      p.q[d] = static_cast<std::int64_t>(std::floor(x * position_scale_));
+    }
+    p.cell = (c[2] * h_.size[1] + c[1]) * h_.size[0] + c[0];
+    for (int k = 3; k < 9; ++k) {
+      p.q[k] = std::llround(static_cast<double>(v[k]) * velocity_scale_);
+    }
+    return p;
+  }
+
+  void dequantize(const quantized_particle & p, float * v) const {
+    for (int d = 0; d < 3; ++d) {
+      const double x = (p.q[d] + 0.5) / position_scale_;
+      v[d] = static_cast<float>(h_.min[d] + x * h_.delta[d]);
+    }
+    for (int k = 3; k < 9; ++k) {
+      v[k] = static_cast<float>(p.q[k] / velocity_scale_);
+    }
+  }
+
+private:
+  const trajectory_header h_;
+  const double position_scale_;
+  const double velocity_scale_;
+};
+
+// Appends frames to a compact trajectory file. Frames are given as
+// particles in file order, simulation_ostream::PARTICLE_FLOATS floats each.
+class trajectory_ostream {
+public:
+  template <typename T>
+  trajectory_ostream(const std::string & name, float ppm, unsigned int np, const domain<T> & d,
+                     unsigned int position_bits, unsigned int velocity_bits);
+
+  void write_frame(int frame, const float * values);
+
+  const trajectory_header & header() const { return header_; }
+
+private:
+  void write_bytes(const std::vector<unsigned char> & bytes);
+
+private:
+  std::ofstream stream_;
+  trajectory_header header_;
+  trajectory_quantizer quantizer_;
+  trajectory_predictor predictor_;
+  std::vector<unsigned char> bytes_;
+};
+
+// Reads a compact trajectory file frame by frame
+class trajectory_istream {
+public:
+  trajectory_istream(const std::string & name);
+
+  const trajectory_header & header() const { return header_; }
+
+  // Decodes the next frame to values, simulation_istream::PARTICLE_FLOATS
+  // floats per particle. Returns false at the end of the file.
+  bool read_frame(int & frame, std::vector<float> & values);
+
+  // Encoded size in bytes of the last frame read
+  std::size_t frame_size() const { return bytes_.size(); }
+
+private:
+  static trajectory_header read_header(std::ifstream & stream);
+
+private:
+  std::ifstream stream_;
+  std::uint64_t file_size_;
+  trajectory_header header_;
+  trajectory_quantizer quantizer_;
+  trajectory_predictor predictor_;
+  std::vector<unsigned char> bytes_;
+};
+
+constexpr char TRAJECTORY_MAGIC[4] = {'F', 'T', 'R', 'J'};
+constexpr std::uint32_t TRAJECTORY_VERSION = 1;
+constexpr std::size_t TRAJECTORY_HEADER_SIZE = 4 + 4 * 17;
+
+// Bound on the grid of a trajectory, which readers allocate per cell
+constexpr std::uint64_t MAX_TRAJECTORY_CELLS = std::uint64_t{1} << 27;
+
+// Channels of a frame: cell steps, matches, then the 9 quantized values in
+// coding order
+constexpr int TRAJECTORY_CHANNELS = 11;
+
+template <typename T>
+trajectory_header make_trajectory_header(float ppm, unsigned int np, const domain<T> & d,
+                                         unsigned int position_bits, unsigned int velocity_bits)
+{
+  if (position_bits > 30 || velocity_bits > 30) {
+    throw std::runtime_error("Trajectory quantization limited to 30 bits");
+  }
+  trajectory_header h;
+  h.ppm = ppm;
+  h.np = np;
+  h.time_step = static_cast<float>(constants::TIME_STEP<T>());
+  const auto min = constants::DOMAIN_MIN<T>();
+  const float mins[3] = {static_cast<float>(min.x()), static_cast<float>(min.y()), static_cast<float>(min.z())};
+  const float deltas[3] = {static_cast<float>(d.delta_.x()), static_cast<float>(d.delta_.y()), static_cast<float>(d.delta_.z())};
+  const std::size_t sizes[3] = {d.size_.template get<0>(), d.size_.template get<1>(), d.size_.template get<2>()};
+  double max_delta = 0;
+  double max_coordinate = 0;
+  for (int k = 0; k < 3; ++k) {
+    h.min[k] = mins[k];
+    h.delta[k] = deltas[k];
+    h.size[k] = static_cast<std::uint32_t>(sizes[k]);
+    max_delta = std::max<double>(max_delta, deltas[k]);
+    max_coordinate = std::max({max_coordinate, std::fabs(double(mins[k])), std::fabs(mins[k] + sizes[k] * double(deltas[k]))});
+  }
+  h.position_bits = position_bits;
+  h.velocity_bits = velocity_bits;
+  // Half a quantization step, plus rounding to float of positions in the
+  // domain. Steps of hv and velocities are exact floats below 2^(24 - bits).
+  h.position_bound = static_cast<float>(std::ldexp(max_delta, -static_cast<int>(position_bits) - 1) +
+                                        std::ldexp(max_coordinate, -24));
+  h.velocity_bound = static_cast<float>(std::ldexp(1.0, -static_cast<int>(velocity_bits) - 1));
+  return h;
+}
+
+template <typename T>
+trajectory_ostream::trajectory_ostream(const std::string & name, float ppm, unsigned int np, const domain<T> & d,
+                                       unsigned int position_bits, unsigned int velocity_bits)
+:
+stream_(name, std::ios::binary),
+header_(make_trajectory_header(ppm, np, d, position_bits, velocity_bits)),
+quantizer_{header_},
+predictor_{header_},
+bytes_{}
+{
+  if (!stream_) {
+    throw std::runtime_error("Error opening trajectory file");
+  }
+  std::vector<unsigned char> b(TRAJECTORY_MAGIC, TRAJECTORY_MAGIC + 4);
+  put_u32(b, TRAJECTORY_VERSION);
+  put_u32(b, float_bits(header_.ppm));
+  put_u32(b, header_.np);
+  put_u32(b, float_bits(header_.time_step));
+  for (int k = 0; k < 3; ++k) put_u32(b, float_bits(header_.min[k]));
+  for (int k = 0; k < 3; ++k) put_u32(b, float_bits(header_.delta[k]));
+  for (int k = 0; k < 3; ++k) put_u32(b, header_.size[k]);
+  put_u32(b, header_.position_bits);
+  put_u32(b, header_.velocity_bits);
+  put_u32(b, float_bits(header_.position_bound));
+  put_u32(b, float_bits(header_.velocity_bound));
+  write_bytes(b);
+}
+
+// Frame: number, size of the payload in bytes and payload
+inline void trajectory_ostream::write_frame(int frame, const float * values)
+{
+  constexpr int nf = simulation_ostream::PARTICLE_FLOATS;
+  bytes_.clear();
+  bit_writer w{bytes_};
+  rice_channel channels[TRAJECTORY_CHANNELS];
+  predictor_.begin_frame(frame, header_.np);
+  std::int64_t cell = 0;
+  for (std::size_t i = 0; i < header_.np; ++i) {
+    const quantized_particle p = quantizer_.quantize(values + i * nf);
+    channels[0].encode(w, zigzag(p.cell - cell));
+    cell = p.cell;
+    predictor_.next(p.cell);
+    const std::size_t match = predictor_.choose(p);
+    channels[1].encode(w, match);
+    predictor_.select(match);
+    for (int j = 0; j < 9; ++j) {
+      const int k = TRAJECTORY_ORDER[j];
+      channels[j + 2].encode(w, zigzag(p.q[k] - predictor_.predict(p, k)));
+    }
+    predictor_.add(p);
+  }
+  predictor_.end_frame();
+  w.flush();
+
+  std::vector<unsigned char> b;
+  put_u32(b, static_cast<std::uint32_t>(frame));
+  put_u64(b, bytes_.size());
+  write_bytes(b);
+  write_bytes(bytes_);
+  stream_.flush();
+}
+
+inline void trajectory_ostream::write_bytes(const std::vector<unsigned char> & bytes)
+{
+  if (!stream_.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()))) {
+    throw std::runtime_error("Error writing trajectory file");
+  }
+}
+
+inline trajectory_istream::trajectory_istream(const std::string & name)
+:
+stream_(name, std::ios::binary),
+file_size_{0},
+header_(read_header(stream_)),
+quantizer_{header_},
+predictor_{header_},
+bytes_{}
+{
+  const auto start = stream_.tellg();
+  stream_.seekg(0, std::ios::end);
+  file_size_ = static_cast<std::uint64_t>(stream_.tellg());
+  stream_.seekg(start);
+}
+
+inline trajectory_header trajectory_istream::read_header(std::ifstream & stream)
+{
+  if (!stream) {
+    throw std::runtime_error("Error opening trajectory file");
+  }
+  unsigned char b[TRAJECTORY_HEADER_SIZE];
+  if (!stream.read(reinterpret_cast<char *>(b), TRAJECTORY_HEADER_SIZE)) {
+    throw std::runtime_error("Trajectory file too short for header");
+  }
+  if (!std::equal(TRAJECTORY_MAGIC, TRAJECTORY_MAGIC + 4, b) || get_u32(b + 4) != TRAJECTORY_VERSION) {
+    throw std::runtime_error("Not a trajectory file of a supported version");
+  }
+  trajectory_header h;
+  const unsigned char * p = b + 8;
+  h.ppm = bits_float(get_u32(p)); p += 4;
+  h.np = get_u32(p); p += 4;
+  h.time_step = bits_float(get_u32(p)); p += 4;
+  for (int k = 0; k < 3; ++k, p += 4) h.min[k] = bits_float(get_u32(p));
+  for (int k = 0; k < 3; ++k, p += 4) h.delta[k] = bits_float(get_u32(p));
+  for (int k = 0; k < 3; ++k, p += 4) h.size[k] = get_u32(p);
+  h.position_bits = get_u32(p); p += 4;
+  h.velocity_bits = get_u32(p); p += 4;
+  h.position_bound = bits_float(get_u32(p)); p += 4;
+  h.velocity_bound = bits_float(get_u32(p));
+  if (h.position_bits > 30 || h.velocity_bits > 30 ||
+      h.size[0] == 0 || h.size[1] == 0 || h.size[2] == 0 || !(h.delta[0] > 0 && h.delta[1] > 0 && h.delta[2] > 0) ||
+      !std::isfinite(h.time_step)) {
+    throw std::runtime_error("Invalid trajectory header");
+  }
+  // Sizes below 2^32 cannot overflow the product before it is checked
+  if (std::uint64_t{h.size[0]} * h.size[1] > MAX_TRAJECTORY_CELLS ||
+      std::uint64_t{h.size[0]} * h.size[1] * h.size[2] > MAX_TRAJECTORY_CELLS) {
+    throw std::runtime_error("Too many cells in trajectory header");
+  }
+  return h;
+}
+
+inline bool trajectory_istream::read_frame(int & frame, std::vector<float> & values)
+{
+  unsigned char b[12];
+  if (!stream_.read(reinterpret_cast<char *>(b), 4)) {
+    if (stream_.gcount() == 0) return false;
+    throw std::runtime_error("Truncated trajectory frame");
+  }
+  if (!stream_.read(reinterpret_cast<char *>(b + 4), 8)) {
+    throw std::runtime_error("Truncated trajectory frame");
+  }
+  frame = static_cast<int>(get_u32(b));
+  // Every particle takes at least a bit per channel
+  const std::uint64_t size = get_u64(b + 4);
+  if (size > file_size_ - static_cast<std::uint64_t>(stream_.tellg()) ||
+      size < (std::uint64_t{header_.np} * TRAJECTORY_CHANNELS + 7) / 8) {
+    throw std::runtime_error("Truncated trajectory frame");
+  }
+  bytes_.resize(size);
+  if (!stream_.read(reinterpret_cast<char *>(bytes_.data()), static_cast<std::streamsize>(bytes_.size()))) {
+    throw std::runtime_error("Truncated trajectory frame");
+  }
+
+  constexpr int nf = simulation_istream::PARTICLE_FLOATS;
+  values.resize(static_cast<std::size_t>(header_.np) * nf);
+  bit_reader r{bytes_.data(), bytes_.size()};
+  rice_channel channels[TRAJECTORY_CHANNELS];
+  predictor_.begin_frame(frame, header_.np);
+  std::int64_t cell = 0;
+  for (std::size_t i = 0; i < header_.np; ++i) {
+    quantized_particle p;
+    cell = wrapping_add(cell, unzigzag(channels[0].decode(r)));
+    if (cell < 0 || static_cast<std::uint64_t>(cell) >= predictor_.num_cells()) {
+      throw std::runtime_error("Invalid trajectory cell");
+    }
+    p.cell = cell;
+    predictor_.next(p.cell);
+    predictor_.select(channels[1].decode(r));
+    for (int j = 0; j < 9; ++j) {
+      const int k = TRAJECTORY_ORDER[j];
+      p.q[k] = wrapping_add(predictor_.predict(p, k), unzigzag(channels[j + 2].decode(r)));
+    }
+    quantizer_.dequantize(p, values.data() + i * nf);
+    predictor_.add(p);
+  }
+  predictor_.end_frame();
+  return true;
+}
+
+}
+
+#endif
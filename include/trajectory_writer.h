@@ -0,0 +1,197 @@
+#ifndef FLUID_TRAJECTORY_WRITER_H
+#define FLUID_TRAJECTORY_WRITER_H
+
+#include "simulation_stream.h"
+#include "trajectory_stream.h"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fluid {
+
+// Writes every interval-th frame of a simulation on a background thread,
+// which calls write(frame, values) with the particles in file order.
+// Snapshots are staged in a pool of backlog buffers, so the simulation
+// only waits for the writer when backlog snapshots are still waiting to be
+// written.
+class trajectory_writer {
+public:
+  using write_function = std::function<void(int, const std::vector<float> &)>;
+
+  trajectory_writer(write_function write, int interval, std::size_t backlog = 2);
+  ~trajectory_writer();
+
+  trajectory_writer(const trajectory_writer &) = delete;
+  trajectory_writer & operator=(const trajectory_writer &) = delete;
+
+  // Stages a snapshot of sim if frame is a multiple of the interval.
+  // Rethrows errors of earlier writes.
+  template <typename S>
+  void record(const S & sim, int frame);
+
+  // Waits for all snapshots to be written. Rethrows errors of writes.
+  void finish();
+
+  std::size_t num_snapshots() const { return snapshots_; }
+
+  // Snapshots that had to wait for a free buffer
+  std::size_t num_stalls() const { return stalls_; }
+
+private:
+  struct snapshot {
+    int frame;
+    std::vector<float> * values;
+  };
+
+  std::vector<float> * acquire_buffer();
+  void run();
+
+private:
+  const write_function write_;
+  const int interval_;
+
+  std::vector<std::vector<float>> buffers_;
+  std::vector<std::vector<float> *> free_buffers_;
+  std::deque<snapshot> pending_;
+  std::size_t snapshots_;
+  std::size_t stalls_;
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  bool stopping_;
+  std::exception_ptr error_;
+
+  // Started last, once everything it uses is built
+  std::thread thread_;
+};
+
+trajectory_writer::trajectory_writer(write_function write, int interval, std::size_t backlog)
+:
+write_{write},
+interval_{interval},
+buffers_(backlog > 0 ? backlog : 1),
+free_buffers_{},
+pending_{},
+snapshots_{0},
+stalls_{0},
+mutex_{},
+changed_{},
+stopping_{false},
+error_{},
+thread_{}
+{
+  for (auto & b : buffers_) {
+    free_buffers_.push_back(&b);
+  }
+  thread_ = std::thread{[this] { run(); }};
+}
+
+trajectory_writer::~trajectory_writer()
+{
+  // Pending snapshots are still written
+  {
+    std::lock_guard<std::mutex> l{mutex_};
+    stopping_ = true;
+  }
+  changed_.notify_all();
+  thread_.join();
+}
+
+template <typename S>
+void trajectory_writer::record(const S & sim, int frame)
+{
+  if (frame % interval_ != 0) return;
+
+  std::vector<float> * values = acquire_buffer();
+  sim.snapshot(*values);
+  {
+    std::lock_guard<std::mutex> l{mutex_};
+    pending_.push_back(snapshot{frame, values});
+  }
+  changed_.notify_all();
+  ++snapshots_;
+}
+
+void trajectory_writer::finish()
+{
+  std::unique_lock<std::mutex> l{mutex_};
+  changed_.wait(l, [this] { return free_buffers_.size() == buffers_.size(); });
+  if (error_) {
+    std::rethrow_exception(error_);
+  }
+}
+
+std::vector<float> * trajectory_writer::acquire_buffer()
+{
+  std::unique_lock<std::mutex> l{mutex_};
+  if (free_buffers_.empty() && !error_) {
+    ++stalls_;
+    changed_.wait(l, [this] { return !free_buffers_.empty() || error_; });
+  }
+  if (error_) {
+    std::rethrow_exception(error_);
+  }
+  std::vector<float> * values = free_buffers_.back();
+  free_buffers_.pop_back();
+  return values;
+}
+
+void trajectory_writer::run()
+{
+  for (;;) {
+    snapshot s{0, nullptr};
+    {
+      std::unique_lock<std::mutex> l{mutex_};
+      changed_.wait(l, [this] { return !pending_.empty() || stopping_; });
+      if (pending_.empty()) return;
+      s = pending_.front();
+      pending_.pop_front();
+    }
+
+    std::exception_ptr error;
+    try {
+      write_(s.frame, *s.values);
+    }
+    catch (const std::exception &) {
+      error = std::current_exception();
+    }
+
+    {
+      std::lock_guard<std::mutex> l{mutex_};
+      if (error && !error_) {
+        error_ = error;
+      }
+      free_buffers_.push_back(s.values);
+    }
+    changed_.notify_all();
+  }
+}
+
+// Snapshots as .fluid files named after name by snapshot_file_name
+trajectory_writer::write_function fluid_snapshots(const std::string & name, float ppm, unsigned int np)
+{
+  return [name, ppm, np](int frame, const std::vector<float> & values) {
+    simulation_ostream os(snapshot_file_name(name, frame));
+    os.write_header(ppm, np);
+    os.write_particles(values.data(), 0, np);
+    os.skip_particles(np);
+  };
+}
+
+// Snapshots as frames of a compact trajectory file
+trajectory_writer::write_function compact_snapshots(std::shared_ptr<trajectory_ostream> os)
+{
+  return [os](int frame, const std::vector<float> & values) {
+    os->write_frame(frame, values.data());
+  };
+}
+
+}
+
+#endif
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Compares single precision particles with particles storing their half
+# velocities and velocities in fp16 or bf16: simulation time and accuracy
+# against the single precision run, as reported by fcmp.
+#$1 -> Source directory
+#$2 -> Number of frames (default 100)
+SRCDIR=$1
+NUMITER=${2:-100}
+
+#build
+#$1 -> build directory
+#$2... -> cmake options
+build() {
+DIR=$1
+shift
+mkdir -p $DIR
+(cd $DIR && cmake $SRCDIR -DCMAKE_BUILD_TYPE=Release -DFLUID_TIMING=ON "$@" > /dev/null && make animate fcmp fgen > /dev/null)
+}
+
+build cold_float
+build cold_fp16 -DFLUID_COLD_FIELDS=fp16
+build cold_bf16 -DFLUID_COLD_FIELDS=bf16
+
+if [ ! -f in_1M.fluid ]; then
+  cold_float/bin/fgen 1200 1000000 in_1M.fluid
+fi
+
+for INFILE in $SRCDIR/in/in_15K.fluid in_1M.fluid
+do
+  NAME=`basename $INFILE .fluid`
+  for CONFIG in float fp16 bf16
+  do
+    KTIME=`cold_$CONFIG/bin/animate 1 $NUMITER $INFILE cold_${CONFIG}_$NAME.fluid | grep time | sed 's/Simulation time: //'`
+    echo $NAME $CONFIG ' ' $KTIME
+  done
+  for CONFIG in fp16 bf16
+  do
+    echo $NAME $CONFIG
+    cold_float/bin/fcmp cold_${CONFIG}_$NAME.fluid cold_float_$NAME.fluid --report
+  done
+done
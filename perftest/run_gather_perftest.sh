@@ -0,0 +1,40 @@
+#!/bin/bash
+# Compares force computation with locked cells, coloured cells, gathering and
+# per-thread buffers for increasing numbers of threads, to find where gathering
+# (twice the arithmetic, no synchronization) or buffering (no locks, extra
+# merge pass) starts to pay off.
+#$1 -> Source directory
+#$2 -> Number of frames (default 100)
+SRCDIR=$1
+NUMITER=${2:-100}
+
+#build
+#$1 -> build directory
+#$2... -> cmake options
+build() {
+DIR=$1
+shift
+mkdir -p $DIR
+(cd $DIR && cmake $SRCDIR -DCMAKE_BUILD_TYPE=Release -DFLUID_TIMING=ON "$@" > /dev/null && make animate_tbb fgen > /dev/null)
+}
+
+build forces_locked
+build forces_coloured -DFLUID_CELL_COLOURING=ON
+build forces_gather -DFLUID_GATHER_FORCES=ON
+build forces_buffered -DFLUID_BUFFERED_FORCES=ON
+
+if [ ! -f in_1M.fluid ]; then
+  forces_locked/bin/fgen 1200 1000000 in_1M.fluid
+fi
+
+for INFILE in $SRCDIR/in/in_15K.fluid in_1M.fluid
+do
+  for NUMTHREADS in 1 2 4 8 16 32 64
+  do
+    for CONFIG in locked coloured gather buffered
+    do
+      KTIME=`forces_$CONFIG/bin/animate_tbb $NUMTHREADS $NUMITER $INFILE | grep time | sed 's/Simulation time: //'`
+      echo `basename $INFILE` $CONFIG $NUMTHREADS ' ' $KTIME
+    done
+  done
+done
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Compares linear and Morton (Z-order) cell traversal for both grid layouts
+# on in_15K.fluid and on a synthetic scene with 1M particles.
+#$1 -> Source directory
+#$2 -> Number of frames (default 100)
+SRCDIR=$1
+NUMITER=${2:-100}
+
+#build
+#$1 -> build directory
+#$2... -> cmake options
+build() {
+DIR=$1
+shift
+mkdir -p $DIR
+(cd $DIR && cmake $SRCDIR -DCMAKE_BUILD_TYPE=Release -DFLUID_TIMING=ON "$@" > /dev/null && make animate animate_tbb fgen > /dev/null)
+}
+
+#do_test
+#$1 -> program to be measured
+#$2 -> input_file
+do_test() {
+PROG=$1
+INFILE=$2
+for NUMTHREADS in 1 2 4 8 16
+do
+  KTIME=`$PROG $NUMTHREADS $NUMITER $INFILE | grep time | sed 's/Simulation time: //'`
+  echo `basename $INFILE` $PROG $NUMTHREADS ' ' $KTIME
+done
+}
+
+build order_cells_linear
+build order_cells_morton -DFLUID_MORTON_ORDER=ON
+build order_contiguous_linear -DFLUID_CONTIGUOUS_GRID=ON
+build order_contiguous_morton -DFLUID_CONTIGUOUS_GRID=ON -DFLUID_MORTON_ORDER=ON
+
+if [ ! -f in_1M.fluid ]; then
+  order_cells_linear/bin/fgen 1200 1000000 in_1M.fluid
+fi
+
+for INFILE in $SRCDIR/in/in_15K.fluid in_1M.fluid
+do
+  for CONFIG in cells_linear cells_morton contiguous_linear contiguous_morton
+  do
+    KTIME=`order_$CONFIG/bin/animate 1 $NUMITER $INFILE | grep time | sed 's/Simulation time: //'`
+    echo `basename $INFILE` $CONFIG animate 1 ' ' $KTIME
+    do_test order_$CONFIG/bin/animate_tbb $INFILE
+  done
+done
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Compares separate phases, fused phases, a frame graph per block of cells
+# and its wavefront over slabs of cells for increasing numbers of threads,
+# to measure the time threads spend waiting at phase barriers and, on the
+# 1M particle scene, the memory traffic saved by keeping slabs in cache.
+#$1 -> Source directory
+#$2 -> Number of frames (default 100)
+SRCDIR=$1
+NUMITER=${2:-100}
+
+#build
+#$1 -> build directory
+#$2... -> cmake options
+build() {
+DIR=$1
+shift
+mkdir -p $DIR
+(cd $DIR && cmake $SRCDIR -DCMAKE_BUILD_TYPE=Release -DFLUID_TIMING=ON "$@" > /dev/null && make animate_tbb fgen > /dev/null)
+}
+
+build phases_separate
+build phases_fused -DFLUID_FUSED_PHASES=ON
+build phases_graph -DFLUID_FRAME_GRAPH=ON
+build phases_wavefront -DFLUID_WAVEFRONT_PHASES=ON
+
+if [ ! -f in_1M.fluid ]; then
+  phases_separate/bin/fgen 1200 1000000 in_1M.fluid
+fi
+
+for INFILE in $SRCDIR/in/in_15K.fluid in_1M.fluid
+do
+  for NUMTHREADS in 1 2 4 8 16 32 64
+  do
+    for CONFIG in separate fused graph wavefront
+    do
+      KTIME=`phases_$CONFIG/bin/animate_tbb $NUMTHREADS $NUMITER $INFILE | grep time | sed 's/Simulation time: //'`
+      echo `basename $INFILE` $CONFIG $NUMTHREADS ' ' $KTIME
+    done
+  done
+done